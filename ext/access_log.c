@@ -0,0 +1,233 @@
+/* asynchronous access log
+ *
+ * the event loop pushes a fixed size record into a single producer / single consumer ring when a response is finished,
+ * a writer thread (not a ruby thread, it never takes GVL) formats the records and writes them in large batches.
+ * when the ring is full, records are dropped instead of blocking the event loop.
+ */
+
+#include "nyara.h"
+#include "request.h"
+#include <pthread.h>
+#include <sys/time.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+
+// must be power of 2
+#define LOG_RING_SIZE 1024
+// path (and query / body if params are logged) kept in a record, longer ones are truncated
+#define LOG_DATA_MAX 1024
+// formatted lines are collected and written when the buffer is nearly full or the ring is drained
+#define LOG_BUF_SIZE 65536
+#define LOG_LINE_MAX (LOG_DATA_MAX + 256)
+// max delay of a record before written
+#define LOG_INTERVAL_NS 10000000
+
+typedef struct {
+  struct timeval at;
+  enum http_method method;
+  int status;
+  long bytes;
+  unsigned long long total;  // ticks from first byte to response finished
+  unsigned long long action; // ticks from dispatch to response finished
+  int path_len;
+  int body_len;              // body follows path in data
+  char data[LOG_DATA_MAX];
+} LogRecord;
+
+static LogRecord* ring = NULL;
+static volatile unsigned long ring_head = 0;   // next to push, written by event loop
+static volatile unsigned long ring_tail = 0;   // next to format, written by writer
+static volatile unsigned long ring_written = 0; // records before this are written to fd
+static volatile bool stopping = false;
+static unsigned long long dropped = 0;
+
+static bool enabled = false;
+static int log_fd = -1;
+static bool log_params = false;
+static bool writer_started = false;
+static pthread_t writer;
+
+static void _write_all(const char* s, long len) {
+  while (len > 0) {
+    long written = write(log_fd, s, len);
+    if (written < 0) {
+      if (errno == EINTR || errno == EAGAIN) {
+        continue;
+      }
+      return; // nowhere to report
+    }
+    s += written;
+    len -= written;
+  }
+}
+
+// "2026-10-17 12:00:00.123 GET /path 200 1024 1.234ms 0.800ms"
+static long _format(LogRecord* r, char* buf, double ms_per_tick, time_t* cached_sec, char* cached_time) {
+  if (r->at.tv_sec != *cached_sec) {
+    struct tm tm;
+    localtime_r(&r->at.tv_sec, &tm);
+    strftime(cached_time, 32, "%Y-%m-%d %H:%M:%S", &tm);
+    *cached_sec = r->at.tv_sec;
+  }
+  long len = snprintf(buf, LOG_LINE_MAX, "%s.%03d %s %.*s %d %ld %.3fms %.3fms",
+                      cached_time, (int)(r->at.tv_usec / 1000), http_method_str(r->method),
+                      r->path_len, r->data, r->status, r->bytes,
+                      r->total * ms_per_tick, r->action * ms_per_tick);
+  if (r->body_len) {
+    len += snprintf(buf + len, LOG_LINE_MAX - len, " body: %.*s", r->body_len, r->data + r->path_len);
+  }
+  buf[len++] = '\n';
+  return len;
+}
+
+static void* _writer_func(void* _) {
+  char* buf = malloc(LOG_BUF_SIZE);
+  long len = 0;
+  double ms_per_tick = 1000 / nyara_ticks_per_sec();
+  time_t cached_sec = 0;
+  char cached_time[32];
+  struct timespec interval = {0, LOG_INTERVAL_NS};
+
+  while (true) {
+    unsigned long head = ring_head;
+    __sync_synchronize();
+    while (ring_tail != head) {
+      if (len + LOG_LINE_MAX > LOG_BUF_SIZE) {
+        _write_all(buf, len);
+        len = 0;
+      }
+      len += _format(ring + (ring_tail & (LOG_RING_SIZE - 1)), buf + len, ms_per_tick, &cached_sec, cached_time);
+      __sync_synchronize();
+      ring_tail++;
+    }
+    if (len) {
+      _write_all(buf, len);
+      len = 0;
+    }
+    ring_written = head;
+    if (stopping && ring_tail == ring_head) {
+      break;
+    }
+    nanosleep(&interval, NULL);
+  }
+  free(buf);
+  return NULL;
+}
+
+// copy with control chars replaced, so a record is always one line
+static int _copy_line(char* dst, const char* s, long len) {
+  for (long i = 0; i < len; i++) {
+    unsigned char c = s[i];
+    dst[i] = (c < 0x20 || c == 0x7f) ? '.' : c;
+  }
+  return (int)len;
+}
+
+// push a record of the finished request, called before it is reset
+void nyara_access_log_push(Request* p) {
+  if (!enabled) {
+    return;
+  }
+  if (ring_head - ring_tail >= LOG_RING_SIZE) {
+    dropped++;
+    return;
+  }
+  LogRecord* r = ring + (ring_head & (LOG_RING_SIZE - 1));
+  gettimeofday(&r->at, NULL);
+  r->method = p->method;
+  r->status = p->status;
+  r->bytes = p->sent_bytes;
+  r->total = p->phases[PH_FIRST_BYTE] ? p->phases[PH_CLOSE] - p->phases[PH_FIRST_BYTE] : 0;
+  r->action = p->phases[PH_DISPATCH] ? p->phases[PH_CLOSE] - p->phases[PH_DISPATCH] : 0;
+  r->path_len = 0;
+  r->body_len = 0;
+
+  if (TYPE(p->path_with_query) == T_STRING) {
+    const char* s = RSTRING_PTR(p->path_with_query);
+    long len = RSTRING_LEN(p->path_with_query);
+    if (!log_params) {
+      // query is a part of params
+      const char* q = memchr(s, '?', len);
+      if (q) {
+        len = q - s;
+      }
+    }
+    r->path_len = _copy_line(r->data, s, len < LOG_DATA_MAX ? len : LOG_DATA_MAX);
+  }
+  // body is logged as received, so params are not built or inspected for logging
+  if (log_params && !p->mparser && TYPE(p->body) == T_STRING &&
+      (p->method == HTTP_POST || p->method == HTTP_PUT || p->method == HTTP_PATCH)) {
+    long len = RSTRING_LEN(p->body);
+    long room = LOG_DATA_MAX - r->path_len;
+    r->body_len = _copy_line(r->data + r->path_len, RSTRING_PTR(p->body), len < room ? len : room);
+  }
+
+  __sync_synchronize();
+  ring_head++;
+}
+
+// wait until records pushed before are written, at most 1 second
+static void _flush() {
+  unsigned long head = ring_head;
+  struct timespec interval = {0, 1000000};
+  for (int i = 0; i < 1000 && writer_started && ring_written < head; i++) {
+    nanosleep(&interval, NULL);
+  }
+}
+
+static void _stop_writer() {
+  if (writer_started) {
+    stopping = true;
+    pthread_join(writer, NULL);
+    writer_started = false;
+    stopping = false;
+  }
+}
+
+// start logging to [fd] in this process, call it after fork
+static VALUE ext_access_log_open(VALUE _, VALUE v_fd, VALUE v_log_params) {
+  _stop_writer();
+  if (!ring) {
+    ring = ALLOC_N(LogRecord, LOG_RING_SIZE);
+  }
+  ring_head = ring_tail = ring_written = 0;
+  log_fd = NUM2INT(v_fd);
+  log_params = RTEST(v_log_params);
+  int err = pthread_create(&writer, NULL, _writer_func, NULL);
+  if (err) {
+    errno = err;
+    rb_sys_fail("pthread_create");
+  }
+  writer_started = true;
+  enabled = true;
+  return Qnil;
+}
+
+// write out pending records and stop the writer thread, also called by the event loop before the worker exits
+void nyara_access_log_close() {
+  enabled = false;
+  _stop_writer();
+}
+
+static VALUE ext_access_log_close(VALUE _) {
+  nyara_access_log_close();
+  return Qnil;
+}
+
+static VALUE ext_access_log_flush(VALUE _) {
+  _flush();
+  return Qnil;
+}
+
+// number of records dropped for the ring is full
+static VALUE ext_access_log_dropped(VALUE _) {
+  return ULL2NUM(dropped);
+}
+
+void Init_access_log(VALUE ext) {
+  rb_define_singleton_method(ext, "access_log_open", ext_access_log_open, 2);
+  rb_define_singleton_method(ext, "access_log_close", ext_access_log_close, 0);
+  rb_define_singleton_method(ext, "access_log_flush", ext_access_log_flush, 0);
+  rb_define_singleton_method(ext, "access_log_dropped", ext_access_log_dropped, 0);
+}
@@ -6,19 +6,37 @@
 
 static struct epoll_event qevents[MAX_E];
 
-static void ADD_E(int fd, VALUE rid) {
+static uint32_t _epoll_events(int interest) {
+  // EPOLLHUP and EPOLLERR are always reported
+  return ((interest & E_READ) ? EPOLLIN : 0) | ((interest & E_WRITE) ? EPOLLOUT : 0) | EPOLLRDHUP | EPOLLET;
+}
+
+static void ADD_E(int fd, uint64_t key, int interest) {
   struct epoll_event e;
-  e.events = EPOLLIN | EPOLLOUT | EPOLLET;
-  e.data.u64 = (uint64_t)rid;
+  e.events = _epoll_events(interest);
+  e.data.u64 = key;
 
+  q.ctl_count++;
   if (epoll_ctl(q.fd, EPOLL_CTL_ADD, fd, &e))
     rb_sys_fail("epoll_ctl(2) - EPOLL_CTL_ADD");
 }
 
+// NOTE the new interest is checked immediately, so a ready fd still gets its event
+static void MOD_E(int fd, uint64_t key, int interest) {
+  struct epoll_event e;
+  e.events = _epoll_events(interest);
+  e.data.u64 = key;
+
+  q.ctl_count++;
+  if (epoll_ctl(q.fd, EPOLL_CTL_MOD, fd, &e))
+    rb_sys_fail("epoll_ctl(2) - EPOLL_CTL_MOD");
+}
+
 // NOTE either epoll or kqueue removes the event watch from queue when fd closed
 static void DEL_E(int fd) {
   struct epoll_event e;
   e.events = EPOLLIN | EPOLLOUT;
+  q.ctl_count++;
   if (epoll_ctl(q.fd, EPOLL_CTL_DEL, fd, &e))
     rb_sys_fail("epoll_ctl(2) - EPOLL_CTL_DEL");
 }
@@ -30,22 +48,44 @@ static void INIT_E() {
   }
 }
 
-static int SELECT_E(st_table* rids) {
-  // heart beat of 0.1 sec, allow ruby signal interrupts to be inserted
-  int sz = epoll_wait(q.fd, qevents, MAX_E, 100);
+typedef struct {
+  int timeout;
+  int sz;
+} EpollWait;
+
+static void* _epoll_wait(void* data) {
+  EpollWait* w = data;
+  w->sz = epoll_wait(q.fd, qevents, MAX_E, w->timeout);
+  return NULL;
+}
+
+static int SELECT_E(st_table* keys, int timeout) {
+  // timeout is capped by heart beat, so timers are checked
+  EpollWait w = {timeout, 0};
+  _wait_without_gvl(_epoll_wait, &w);
+  int sz = w.sz;
   int accept_sz = 0;
 
   for (int i = 0; i < sz; i++) {
-    if (qevents[i].events & (EPOLLIN | EPOLLOUT)) {
-      VALUE rid = (VALUE)qevents[i].data.u64;
-      if (rid == sym_accept) {
+    uint32_t events = qevents[i].events;
+    uint64_t key = qevents[i].data.u64;
+    if (key == ACCEPT_KEY) {
+      if (events & EPOLLIN) {
         accept_sz++;
-      } else {
-        st_insert(rids, rid, 0);
       }
+    } else if (events & (EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+      // EPOLLRDHUP alone is a half-closed client, data before the eof is still read and served
+      _add_key(keys, key, events & (EPOLLHUP | EPOLLERR));
     }
-    // do sth to EPOLLHUP | EPOLLERR | EPOLLRDHUP ?
   }
 
   return accept_sz;
 }
+
+static int ACCEPT_E(int server_fd) {
+  return nyara_accept(server_fd);
+}
+
+// NOTE closed fds are removed from the queue automatically
+static void CLOSE_E(int fd) {
+}
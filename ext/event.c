@@ -2,44 +2,185 @@
 
 #include "nyara.h"
 #include "request.h"
+#include "inc/rdtsc.h"
 #include <sys/fcntl.h>
 #include <sys/socket.h>
+#include <sys/time.h>
 #include <errno.h>
 #include <stdint.h>
 #include <unistd.h>
 #include <ruby/st.h>
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+# include <ruby/thread.h>
+#endif
+#ifdef HAVE_SYS_EVENTFD_H
+# include <sys/eventfd.h>
+#endif
 
 #define MAX_E 1024
 #define MAX_RECEIVE_DATA 65536 * 2
+// max milliseconds to wait for events, allow ruby signal interrupts and threads to be inserted
+#define HEARTBEAT_MS 100
+// max number of idle action fibers kept in a worker
+#define FIBER_POOL_MAX 1024
+
+// event data for the listening fd
+#define ACCEPT_KEY UINT64_MAX
+// event data for the wakeup fd
+#define WAKE_KEY (UINT64_MAX - 1)
+
+// marks event data of fds watched by the action, see _conn_key
+#define WATCHED_KEY_BIT (1ULL << 63)
+#define GEN_MASK 0x7fffffff
+
+// event interest of a fd
+#define E_READ 1
+#define E_WRITE 2
+
+// timer heap entry, `at` may be earlier than the actual deadline of the request,
+// then it is re-scheduled when popped. this way touching a request doesn't need to update the heap
+typedef struct {
+  long at; // in milliseconds
+  Request* request;
+} Timer;
+
+// connection slot, indexed by fd
+// gen increases every time the slot is taken, so events of a closed fd are not mistaken for the new connection
+typedef struct {
+  Request* request;
+  uint32_t gen;
+} Conn;
 
 static struct {
   int fd;
   int tcp_server_fd;
   char received_data[MAX_RECEIVE_DATA];
-  VALUE rid_request_map; // {rid(FIXNUM) => request}
-  VALUE to_resume_requests; // [request], for current round
+  Conn* conns;   // fd => connection
+  int conns_capa;
+  long conns_size;
+  Timer* timers; // min heap of connection deadlines
+  long timers_capa;
+  long timers_size;
+  Request* wake_head;     // lock-free stack of requests to wake, pushed by any thread
+  Request* wake_draining; // rest of the stack being woken in current round
+  int wake_fd;  // read end of wakeup signal, registered in the event queue
+  int wake_wfd; // write end of wakeup signal, same as wake_fd for eventfd
+  VALUE fiber_pool; // [fiber], idle action fibers waiting for the next request
   Request* curr_request;
   bool graceful_quit;
   int inactive_timeout;
+  int keep_alive_max;     // max requests in a connection, 0 to disable keep-alive
+  int keep_alive_timeout; // idle seconds before closing a kept-alive connection
+  int accept_batch;       // max connections accepted in a round
+  bool accept_pending;    // last round stopped at accept_batch, the listener may not be drained
+  long read_budget;       // max bytes read from a connection in a round
+  long cpu_budget;        // microseconds an action runs before yield_if_over_budget yields, 0 to disable
+  long resumed_at;        // in microseconds, when current action is resumed
+  uint64_t* requeued;     // keys of connections to be handled again next round
+  long requeued_len;
+  long requeued_capa;
+  unsigned long long ctl_count;    // event registration syscalls
+  unsigned long long disconnect_count; // connections closed by client or broken
+  unsigned long long cancel_count;     // actions cancelled because of disconnect
 } q = {
   .fd = 0,
   .tcp_server_fd = 0,
+  .wake_head = NULL,
+  .wake_draining = NULL,
+  .wake_fd = -1,
+  .wake_wfd = -1,
   .graceful_quit = false,
   .inactive_timeout = 120,
+  .keep_alive_max = 100,
+  .keep_alive_timeout = 5,
+  .accept_batch = 64,
+  .accept_pending = false,
+  .read_budget = 262144,
+  .cpu_budget = 0,
+  .requeued = NULL,
+  .requeued_len = 0,
+  .requeued_capa = 0,
+  .ctl_count = 0,
+  .disconnect_count = 0,
+  .cancel_count = 0,
+  .conns = NULL,
+  .conns_capa = 0,
+  .conns_size = 0,
+  .timers = NULL,
+  .timers_capa = 0,
+  .timers_size = 0,
   .curr_request = NULL
 };
 
-static VALUE sym_accept;
 // Fiber.yield
 static VALUE sym_term_close;
 static VALUE sym_writing;
 static VALUE sym_reading;
 static VALUE sym_sleep;
+static VALUE sym_cancel;
+static VALUE sym_requeue;
+static VALUE fiber_done_token; // yielded by a pooled fiber when its request is dispatched
+
+// interrupt SELECT_E
+static void _wake_signal() {
+  if (q.wake_wfd >= 0) {
+    uint64_t one = 1;
+    if (write(q.wake_wfd, &one, sizeof(one)) < 0) {
+      // EAGAIN: signal is pending already
+    }
+  }
+}
+
+static void _wait_unblock(void* _) {
+  _wake_signal();
+}
+
+// run the blocking part of SELECT_E without GVL, so other ruby threads run while the loop is idle.
+// when ruby needs this thread back (signal traps, Thread#raise, exit), the wait is interrupted by wakeup signal
+static void _wait_without_gvl(void* (*func)(void*), void* data) {
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+  rb_thread_call_without_gvl(func, data, _wait_unblock, NULL);
+#else
+  func(data);
+#endif
+}
+
+// collect event keys for this round, value is true if the connection is hung up
+static void _add_key(st_table* keys, uint64_t key, bool hangup) {
+  if (key & WATCHED_KEY_BIT) {
+    // a broken watched fd is reported by its own send / recv
+    key &= ~WATCHED_KEY_BIT;
+    hangup = false;
+  }
+  st_data_t v = 0;
+  st_lookup(keys, (st_data_t)key, &v);
+  st_insert(keys, (st_data_t)key, v || hangup);
+}
 
 #ifdef HAVE_KQUEUE
 #include "kqueue.h"
 #elif HAVE_EPOLL
-#include "epoll.h"
+# ifdef HAVE_LIBURING
+// both are compiled, io_uring.h dispatches to the one chosen in Ext.init_queue
+#  define ADD_E EPOLL_ADD_E
+#  define MOD_E EPOLL_MOD_E
+#  define DEL_E EPOLL_DEL_E
+#  define INIT_E EPOLL_INIT_E
+#  define SELECT_E EPOLL_SELECT_E
+#  define ACCEPT_E EPOLL_ACCEPT_E
+#  define CLOSE_E EPOLL_CLOSE_E
+#  include "epoll.h"
+#  undef ADD_E
+#  undef MOD_E
+#  undef DEL_E
+#  undef INIT_E
+#  undef SELECT_E
+#  undef ACCEPT_E
+#  undef CLOSE_E
+#  include "io_uring.h"
+# else
+#  include "epoll.h"
+# endif
 #endif
 
 #ifndef rb_obj_hide
@@ -49,7 +190,193 @@ extern VALUE rb_obj_reveal(VALUE obj, VALUE klass);
 
 extern http_parser_settings nyara_request_parse_settings;
 
-static VALUE _fiber_func(VALUE _, VALUE args) {
+// event data for fds belong to the request: (gen << 32) | fd, the top bit is set for watched fds
+static uint64_t _conn_key(Request* p) {
+  uint32_t gen = (p->fd < q.conns_capa ? q.conns[p->fd].gen & GEN_MASK : 0);
+  return ((uint64_t)gen << 32) | (uint32_t)p->fd;
+}
+
+static Request* _conn_lookup(uint64_t key) {
+  int fd = (int)(key & 0xffffffff);
+  if (fd < q.conns_capa && (q.conns[fd].gen & GEN_MASK) == (uint32_t)(key >> 32)) {
+    return q.conns[fd].request;
+  }
+  return NULL;
+}
+
+static void _conn_add(Request* p) {
+  if (p->fd >= q.conns_capa) {
+    int capa = q.conns_capa ? q.conns_capa : 1024;
+    while (capa <= p->fd) {
+      capa *= 2;
+    }
+    REALLOC_N(q.conns, Conn, capa);
+    MEMZERO(q.conns + q.conns_capa, Conn, capa - q.conns_capa);
+    q.conns_capa = capa;
+  }
+  Conn* c = q.conns + p->fd;
+  c->request = p;
+  c->gen++;
+  q.conns_size++;
+  nyara_score->conns = q.conns_size;
+}
+
+static void _conns_mark(void* _) {
+  for (int i = 0; i < q.conns_capa; i++) {
+    if (q.conns[i].request) {
+      rb_gc_mark(q.conns[i].request->self);
+    }
+  }
+  for (Request* p = q.wake_head; p; p = p->wake_next) {
+    rb_gc_mark(p->self);
+  }
+  for (Request* p = q.wake_draining; p; p = p->wake_next) {
+    rb_gc_mark(p->self);
+  }
+}
+
+static long _now_ms() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+// keep number of sleeping actions in scoreboard
+static void _set_sleeping(Request* p, bool sleeping) {
+  if (p->sleeping != sleeping) {
+    p->sleeping = sleeping;
+    if (sleeping) {
+      nyara_score->sleeping++;
+    } else {
+      nyara_score->sleeping--;
+    }
+  }
+}
+
+static long _now_us() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+// the connection used up its budget in this round, handle it again next round.
+// no event will come for data already in socket buffer (edge-triggered)
+static void _requeue(Request* p) {
+  if (q.requeued_len == q.requeued_capa) {
+    q.requeued_capa = q.requeued_capa ? q.requeued_capa * 2 : 64;
+    REALLOC_N(q.requeued, uint64_t, q.requeued_capa);
+  }
+  q.requeued[q.requeued_len++] = _conn_key(p);
+}
+
+// merge requeued connections into keys of this round
+static void _take_requeued(st_table* keys) {
+  for (long i = 0; i < q.requeued_len; i++) {
+    _add_key(keys, q.requeued[i], false);
+  }
+  q.requeued_len = 0;
+}
+
+// when the request should be woken up or swept
+static long _request_deadline(Request* p) {
+  if (p->sleeping) {
+    return p->wake_at;
+  }
+  // kept-alive connection waiting for next request
+  bool idle = (p->served && p->parse_state == PS_INIT);
+  return (p->updated_at + (idle ? q.keep_alive_timeout : q.inactive_timeout)) * 1000;
+}
+
+static void _timer_place(long i, Timer t) {
+  q.timers[i] = t;
+  t.request->timer_index = i;
+}
+
+static void _timer_sift_up(long i) {
+  Timer t = q.timers[i];
+  while (i > 0) {
+    long parent = (i - 1) / 2;
+    if (q.timers[parent].at <= t.at) {
+      break;
+    }
+    _timer_place(i, q.timers[parent]);
+    i = parent;
+  }
+  _timer_place(i, t);
+}
+
+static void _timer_sift_down(long i) {
+  Timer t = q.timers[i];
+  while (true) {
+    long child = i * 2 + 1;
+    if (child >= q.timers_size) {
+      break;
+    }
+    if (child + 1 < q.timers_size && q.timers[child + 1].at < q.timers[child].at) {
+      child++;
+    }
+    if (t.at <= q.timers[child].at) {
+      break;
+    }
+    _timer_place(i, q.timers[child]);
+    i = child;
+  }
+  _timer_place(i, t);
+}
+
+// schedule or re-schedule request at deadline
+static void _timer_set(Request* p, long at) {
+  long i = p->timer_index;
+  if (i < 0) {
+    if (q.timers_size == q.timers_capa) {
+      q.timers_capa = q.timers_capa ? q.timers_capa * 2 : 1024;
+      REALLOC_N(q.timers, Timer, q.timers_capa);
+    }
+    i = q.timers_size++;
+    q.timers[i].at = at;
+    q.timers[i].request = p;
+    _timer_sift_up(i);
+  } else if (at < q.timers[i].at) {
+    q.timers[i].at = at;
+    _timer_sift_up(i);
+  } else {
+    q.timers[i].at = at;
+    _timer_sift_down(i);
+  }
+}
+
+static void _timer_remove(Request* p) {
+  long i = p->timer_index;
+  if (i < 0) {
+    return;
+  }
+  p->timer_index = -1;
+  q.timers_size--;
+  if (i < q.timers_size) {
+    _timer_place(i, q.timers[q.timers_size]);
+    _timer_sift_up(i);
+    _timer_sift_down(q.timers[i].request->timer_index);
+  }
+}
+
+// milliseconds to wait for events
+static int _select_timeout() {
+  if (q.accept_pending || q.requeued_len) {
+    return 0;
+  }
+  if (!q.timers_size) {
+    return HEARTBEAT_MS;
+  }
+  long timeout = q.timers[0].at - _now_ms();
+  if (timeout < 0) {
+    return 0;
+  }
+  return timeout < HEARTBEAT_MS ? (int)timeout : HEARTBEAT_MS;
+}
+
+// action fibers are pooled: a fiber is resumed with a request to serve,
+// and yields fiber_done_token after dispatch, then waits there for the next request
+static VALUE _fiber_func(VALUE request, VALUE _) {
   static VALUE controller_class = Qnil;
   static ID id_dispatch;
   if (controller_class == Qnil) {
@@ -57,266 +384,601 @@ static VALUE _fiber_func(VALUE _, VALUE args) {
     controller_class = rb_const_get(controller_class, rb_intern("Controller"));
     id_dispatch = rb_intern("dispatch");
   }
-  rb_apply(controller_class, id_dispatch, args);
+  while (true) {
+    Request* p;
+    Data_Get_Struct(request, Request, p);
+    VALUE argv[] = {request, p->instance};
+    rb_funcall2(controller_class, id_dispatch, 2, argv);
+    request = rb_fiber_yield(1, &fiber_done_token);
+  }
   return Qnil;
 }
 
-static void _resume_action(Request* p) {
-  VALUE state = rb_fiber_resume(p->fiber, 0, NULL);
-  if (state == Qnil) { // _fiber_func always returns Qnil
-    // terminated (todo log raised error ?)
+// finish the response after all buffered output is sent
+static void _term_close(Request* p) {
+  if (p->out_len) {
+    p->term_pending = true;
+  } else {
     nyara_request_term_close(p->self);
+  }
+}
+
+// [arg] is the request when the action starts, Qundef when it continues
+static VALUE _resume_action(Request* p, VALUE arg) {
+  q.resumed_at = _now_us();
+  VALUE state = (arg == Qundef ? rb_fiber_resume(p->fiber, 0, NULL) : rb_fiber_resume(p->fiber, 1, &arg));
+  if (state == fiber_done_token) {
+    // dispatch returned, the fiber is idle and must not be resumed by this request again
+    p->fiber_done = true;
+    state = sym_term_close;
+  }
+  p->yielded = state;
+
+  // flush output collected in this round, the rest is sent on writable events
+  if (!nyara_request_flush(p)) {
+    p->keep_alive = false;
+  }
+
+  if (state == Qnil) {
+    // bare Fiber.yield in action
+    _term_close(p);
   } else if (state == sym_term_close) {
-    nyara_request_term_close(p->self);
+    _term_close(p);
   } else if (state == sym_writing) {
     // do nothing
   } else if (state == sym_reading) {
     // do nothing
   } else if (state == sym_sleep) {
     // do nothing
+  } else if (state == sym_requeue) {
+    _requeue(p);
+  }
+  return state;
+}
+
+// take an idle fiber from pool and start the action with it
+static VALUE _start_action(Request* p) {
+  if (RARRAY_LEN(q.fiber_pool)) {
+    p->fiber = rb_ary_pop(q.fiber_pool);
+  } else {
+    p->fiber = rb_fiber_new(_fiber_func, Qnil);
+  }
+  p->fiber_done = false;
+  p->phases[PH_DISPATCH] = rdtsc();
+  return _resume_action(p, p->self);
+}
+
+// put the fiber back to pool if the action finished
+void nyara_fiber_release(Request* p) {
+  if (p->fiber_done) {
+    if (RARRAY_LEN(q.fiber_pool) < FIBER_POOL_MAX) {
+      rb_ary_push(q.fiber_pool, p->fiber);
+    }
+    p->fiber = Qnil;
+    p->fiber_done = false;
   }
 }
 
+// feed data to parser<br>
+// if message completes in the middle, the rest is kept for the next pipelined request
+static void _parse_data(Request* p, const char* s, long len) {
+  if (!p->phases[PH_FIRST_BYTE]) {
+    p->phases[PH_FIRST_BYTE] = rdtsc();
+  }
+  bool ok = (HTTP_PARSER_ERRNO(&(p->hparser)) == HPE_OK && p->parse_state != PS_ERROR);
+  long parsed = http_parser_execute(&(p->hparser), &nyara_request_parse_settings, s, len);
+  // HPE_PAUSED is set by on_message_complete, not an error
+  enum http_errno err = HTTP_PARSER_ERRNO(&(p->hparser));
+  if (ok && ((err != HPE_OK && err != HPE_PAUSED) || p->parse_state == PS_ERROR)) {
+    nyara_score->parse_errors++;
+  }
+  if (p->parse_state == PS_MESSAGE_COMPLETE && parsed < len) {
+    if (p->pipelined == Qnil) {
+      p->pipelined = rb_str_new(s + parsed, len - parsed);
+    } else {
+      rb_str_cat(p->pipelined, s + parsed, len - parsed);
+    }
+  }
+}
+
+// parse data of pipelined request left by last message
+static void _parse_pipelined(Request* p) {
+  volatile VALUE pipelined = p->pipelined;
+  p->pipelined = Qnil;
+  _parse_data(p, RSTRING_PTR(pipelined), RSTRING_LEN(pipelined));
+}
+
+// close the connection now, and resume the action with :cancel so Nyara::Cancelled is raised at its yield point
+static void _cancel_request(Request* p) {
+  bool cancel = (p->fiber != Qnil && !p->fiber_done && p->yielded != sym_term_close && rb_fiber_alive_p(p->fiber));
+  p->cancelled = true;
+  nyara_detach_request(p);
+  if (cancel) {
+    q.cancel_count++;
+    q.curr_request = p;
+    _resume_action(p, sym_cancel);
+    // detached while the action was running, so the fiber and request are released here when it finishes
+    nyara_fiber_release(p);
+    if (!p->fd) {
+      nyara_request_recycle(p);
+    }
+  }
+}
+
+// client disconnected or connection broken
+// NOTE a half-closed client (shutdown after sending request) doesn't get here until its request is served,
+// the adapters report only a broken connection as hangup, and eof is read after the complete message
+static void _hangup(Request* p) {
+  q.disconnect_count++;
+  _cancel_request(p);
+}
+
 static void _handle_request(VALUE request) {
   Request* p;
   Data_Get_Struct(request, Request, p);
   nyara_request_touch(p);
   if (p->sleeping) {
+    // the edge is lost, re-arm registration after wake up
+    p->interest = -1;
     return;
   }
+
+  // pending output
+  if (p->out_len) {
+    if (!nyara_request_flush(p)) {
+      p->keep_alive = false;
+    }
+    if (p->out_len) {
+      return;
+    }
+  }
+  if (p->term_pending) {
+    p->term_pending = false;
+    nyara_request_term_close(request);
+    if (!p->fd) {
+      return;
+    }
+  }
   q.curr_request = p;
+  long read_total = 0;
 
-  // read and parse data
-  // NOTE we don't let http_parser invoke ruby code, because:
-  // 1. so the stack is shallower
-  // 2. Fiber.yield can pause http_parser, then the unparsed received_data is lost
-  if (p->parse_state < PS_MESSAGE_COMPLETE) {
-    while (true) {
+  // loop for keep-alive requests
+  while (true) {
+    // read and parse data
+    // NOTE we don't let http_parser invoke ruby code, because:
+    // 1. so the stack is shallower
+    // 2. Fiber.yield can pause http_parser, then the unparsed received_data is lost
+    if (p->parse_state < PS_MESSAGE_COMPLETE && p->pipelined != Qnil) {
+      _parse_pipelined(p);
+    }
+    bool backpressure = false;
+    while (p->parse_state < PS_MESSAGE_COMPLETE) {
+      // leave data in socket buffer until the action consumes the streamed chunk
+      if (nyara_request_body_pending(p)) {
+        backpressure = true;
+        break;
+      }
       long len = read(p->fd, q.received_data, MAX_RECEIVE_DATA);
       if (len < 0) {
         if (errno == EAGAIN || errno == EWOULDBLOCK) {
+          nyara_score->eagain++;
           break;
         } else {
           // when the other side shutdown
+          _hangup(p);
           return;
         }
       } else if (len) {
-        // note: for http_parser, len = 0 means eof reached
-        //       but when in a fd-becomes-writable event it can also be 0
-        http_parser_execute(&(p->hparser), &nyara_request_parse_settings, q.received_data, len);
+        _parse_data(p, q.received_data, len);
+        nyara_score->bytes_in += len;
+        read_total += len;
+        if (read_total >= q.read_budget && p->parse_state < PS_MESSAGE_COMPLETE) {
+          // let other connections in this round go first
+          _requeue(p);
+          break;
+        }
       } else {
-        break;
+        // eof before the message completes, it can never complete.
+        // or eof between keep-alive requests, the previous response is already sent, it is not a disconnect
+        if (p->fiber != Qnil && !p->fiber_done) {
+          _hangup(p);
+        } else {
+          nyara_detach_request(p);
+        }
+        return;
       }
     }
-  }
 
-  if (p->parse_state == PS_INIT) {
-    return;
-  }
+    if (p->parse_state == PS_INIT) {
+      return;
+    }
+    if (p->parse_state == PS_ERROR) {
+      // malformed, or the body can't be stored, no way to read the rest of the message
+      _cancel_request(p);
+      return;
+    }
+    if (p->fiber_done) {
+      // finished, waiting for output sent or detach, the fiber may serve another request already
+      return;
+    }
 
-  // ensure action
-  if (p->fiber == Qnil) {
-    volatile RouteResult result = nyara_lookup_route(p->method, p->path, p->accept);
-    if (RTEST(result.controller)) {
-      p->instance = rb_class_new_instance(1, &(p->self), result.controller);
+    // ensure action
+    if (p->fiber == Qnil) {
+      volatile RouteResult result = nyara_lookup_route(p->method, p->path, p->accept);
+      // result.args is on stack, no need to worry gc
+      for (int i = 0; i < result.args_len; i++) {
+        p->route_args[i] = result.args[i];
+      }
+      p->route_args_len = result.args_len;
+      p->phases[PH_ROUTE] = rdtsc();
+      if (RTEST(result.controller)) {
+        p->route_id = result.route_id;
+        p->instance = rb_class_new_instance(1, &(p->self), result.controller);
+      }
+      p->scope = result.scope;
+      p->format = result.format;
+      p->cookie = rb_class_new_instance(0, NULL, nyara_param_hash_class);
+      p->response_header = rb_class_new_instance(0, NULL, nyara_header_hash_class);
+      p->response_header_extra_lines = rb_ary_new();
     }
-    // result.args is on stack, no need to worry gc
-    p->scope = result.scope;
-    p->format = result.format;
-    p->cookie = rb_class_new_instance(0, NULL, nyara_param_hash_class);
-    p->response_header = rb_class_new_instance(0, NULL, nyara_header_hash_class);
-    p->response_header_extra_lines = rb_ary_new();
-    p->fiber = rb_fiber_new(_fiber_func, rb_ary_new3(3, p->self, p->instance, result.args));
-  }
 
-  _resume_action(p);
-}
+    VALUE state = (p->fiber == Qnil ? _start_action(p) : _resume_action(p, Qundef));
 
-static int _handle_request_cb(VALUE rid, VALUE _, VALUE _args) {
-  VALUE request = rb_hash_aref(q.rid_request_map, rid);
-  if (request != Qnil) {
-    _handle_request(request);
+    if (p->fiber != Qnil) {
+      // the action consumed the streamed chunk and waits for more,
+      // no event will come for data already in socket buffer (edge-triggered)
+      if (backpressure && state == sym_reading && p->fd && !nyara_request_body_pending(p)) {
+        continue;
+      }
+      return;
+    }
+    // continue only when the request is reset for keep-alive
+    if (!p->fd) {
+      return;
+    }
   }
-  return ST_CONTINUE;
 }
 
-typedef struct {
-  long updated_at;
-  VALUE to_sweep;
-  VALUE to_resume;
-} SweepRidsCbData;
+// deadline changes after request is finished or reset for keep-alive.
+// sleeping requests are scheduled by request_sleep
+static void _reschedule(Request* p) {
+  if (p->fd && !p->sleeping) {
+    _timer_set(p, _request_deadline(p));
+  }
+}
 
-static int _sweep_rids_cb(VALUE rid, VALUE request, VALUE v_data) {
-  Request* p;
-  Data_Get_Struct(request, Request, p);
-  if (!p->sleeping) {
-    SweepRidsCbData* data = (SweepRidsCbData*)v_data;
-    if (p->updated_at < data->updated_at) {
-      rb_ary_push(data->to_sweep, rid);
-    } else if (p->fiber != Qnil) {
-      rb_ary_push(data->to_resume, request);
-    }
+// watch the connection only for what the request is waiting on,
+// so writable edges don't wake up a request waiting for input, and vice versa.
+// a sleeping request keeps its registration, events are ignored until it is woken up.
+// NOTE watched fds are always registered for both
+static void _update_interest(Request* p) {
+  if (!q.fd || !p->fd || p->sleeping) {
+    return;
+  }
+  int interest = 0;
+  if (p->yielded == sym_requeue && p->interest > 0) {
+    // the action is resumed next round anyway, keep the registration
+    interest = p->interest;
+  }
+  if (p->fiber == Qnil || p->yielded == sym_reading) {
+    interest |= E_READ;
+  }
+  if (p->out_len || p->yielded == sym_writing) {
+    interest |= E_WRITE;
+  }
+  if (interest != p->interest) {
+    MOD_E(p->fd, _conn_key(p), interest);
+    p->interest = interest;
   }
-  return ST_CONTINUE;
 }
 
-static void _loop_body_full() {
-  // sweep timed out rids and resume other non sleeping ones
-  struct timeval tv;
-  gettimeofday(&tv, NULL);
-  volatile SweepRidsCbData data = {
-    .updated_at = tv.tv_sec - q.inactive_timeout,
-    .to_sweep = rb_ary_new(),
-    .to_resume = rb_ary_new()
-  };
-
-  long len;
-  VALUE* ptr;
-  rb_hash_foreach(q.rid_request_map, _sweep_rids_cb, (VALUE)&data);
-  len = RARRAY_LEN(data.to_sweep);
-  ptr = RARRAY_PTR(data.to_sweep);
-  for (long i = 0; i < len; i++) {
-    rb_hash_delete(q.rid_request_map, ptr[i]);
-  }
-  len = RARRAY_LEN(data.to_resume);
-  ptr = RARRAY_PTR(data.to_resume);
-  for (long i = 0; i < len; i++) {
-    _handle_request(ptr[i]);
-  }
-
-  // loop some more rounds in case we miss some accepts
-  // todo change i according to worker number
-  for (int i = 0; i < 5; i++) {
-    int cfd = accept(q.tcp_server_fd, NULL, NULL);
+// accept at most [accept_sz] connections, accepted fds are already non-blocking
+static void _accept_requests(int accept_sz) {
+  q.accept_pending = false;
+  for (int i = 0; i < accept_sz; i++) {
+    int cfd = ACCEPT_E(q.tcp_server_fd);
     if (cfd > 0) {
-      nyara_set_nonblock(cfd);
+      nyara_score->accepts++;
       Request* p = nyara_request_new(cfd);
-      rb_hash_aset(q.rid_request_map, p->rid, p->self);
-      ADD_E(cfd, p->rid);
+      _conn_add(p);
+      ADD_E(cfd, _conn_key(p), E_READ);
+      p->interest = E_READ;
       // do first processing after adding event
       // because there may be unprocessed data in socket buffer
       _handle_request(p->self);
+      _reschedule(p);
+      _update_interest(p);
     } else {
-      break;
+      return;
     }
   }
+  // edge triggered: the rest connections won't get another event, drain them next round
+  q.accept_pending = true;
 }
 
-// platform independent, invoked by LOOP_E()
-static void _loop_body(st_table* rids, int accept_sz) {
-  st_foreach(rids, _handle_request_cb, Qnil);
+static int _handle_request_cb(st_data_t key, st_data_t hangup, st_data_t _args) {
+  if ((uint64_t)key == WAKE_KEY) {
+    // wake list is drained every round
+    return ST_CONTINUE;
+  }
+  Request* p = _conn_lookup((uint64_t)key);
+  if (p && hangup) {
+    _hangup(p);
+  } else if (p) {
+    _handle_request(p->self);
+    _reschedule(p);
+    _update_interest(p);
+  }
+  return ST_CONTINUE;
+}
 
-  // accept
-  for (int i = 0; i < accept_sz; i++) {
-    int cfd = accept(q.tcp_server_fd, NULL, NULL);
-    if (cfd > 0) {
-      nyara_set_nonblock(cfd);
-      Request* p = nyara_request_new(cfd);
-      rb_hash_aset(q.rid_request_map, p->rid, p->self);
-      ADD_E(cfd, p->rid);
-      // do first processing after adding event
-      // because there may be unprocessed data in socket buffer
-      _handle_request(p->self);
-    } else {
-      break;
+// resume sleeping request, or sweep request timed out
+static void _wake_request(Request* p) {
+  _set_sleeping(p, false);
+  if (p->fiber == Qnil || p->fiber_done || !rb_fiber_alive_p(p->fiber) || !p->fd) { // do not wake dead requests
+    _reschedule(p);
+    _update_interest(p);
+    return;
+  }
+
+  nyara_request_touch(p);
+  q.curr_request = p;
+  _resume_action(p, Qundef);
+  if (p->fd && p->fiber == Qnil) {
+    // reset for keep-alive, there may be pipelined request
+    _handle_request(p->self);
+  }
+  _reschedule(p);
+  _update_interest(p);
+}
+
+// push request to the wake list, safe to call from any thread (with or without GVL).
+// the list is a lock-free stack, returns true if it was empty, then the event loop should be signalled
+static bool _wake_push(Request* p) {
+  if (__sync_lock_test_and_set(&p->wake_queued, 1)) {
+    // already queued
+    return false;
+  }
+  Request* head;
+  do {
+    head = q.wake_head;
+    p->wake_next = head;
+  } while (!__sync_bool_compare_and_swap(&q.wake_head, head, p));
+  return head == NULL;
+}
+
+// wake requests in the wake list, in the order they are pushed
+static void _wake_requests() {
+  if (!q.wake_head) {
+    return;
+  }
+  Request* p = __sync_lock_test_and_set(&q.wake_head, NULL);
+  if (q.wake_fd >= 0) {
+    char buf[64];
+    while (read(q.wake_fd, buf, sizeof(buf)) > 0) {
     }
   }
 
-  // execute other thread / interrupts
-  rb_thread_schedule();
+  // reverse the stack
+  Request* list = NULL;
+  while (p) {
+    Request* next = p->wake_next;
+    p->wake_next = list;
+    list = p;
+    p = next;
+  }
 
-  // wakeup actions which finished sleeping
-  long len = RARRAY_LEN(q.to_resume_requests);
-  if (len) {
-    VALUE* ptr = RARRAY_PTR(q.to_resume_requests);
-    for (long i = 0; i < len; i++) {
-      VALUE request = ptr[i];
-      Request* p;
-      Data_Get_Struct(request, Request, p);
-
-      p->sleeping = false;
-      if (!rb_fiber_alive_p(p->fiber) || !p->fd) { // do not wake dead requests
-        continue;
-      }
+  // the rest of list is marked through wake_draining
+  while (list) {
+    p = list;
+    list = p->wake_next;
+    q.wake_draining = list;
+    p->wake_next = NULL;
+    __sync_lock_release(&p->wake_queued);
+    if (p->wake_gen != p->gen) {
+      // the request is reset or recycled after the wakeup
+      p->wake_gen = 0;
+    } else if (p->sleeping) {
+      p->wake_gen = 0;
+      _wake_request(p);
+    }
+    // else kept pending, the next sleep of the request returns at once
+  }
+  q.wake_draining = NULL;
+}
 
-      _resume_action(p);
-      if (q.fd) {
-        // printf("%s\n", "no way!");
-        // _Exit(1);
-        VALUE* v_fds = RARRAY_PTR(p->watched_fds);
-        long v_fds_len = RARRAY_LEN(p->watched_fds);
-        for (long i = 0; i < v_fds_len; i++) {
-          ADD_E(FIX2INT(v_fds[i]), p->rid);
-        }
-        ADD_E(p->fd, p->rid);
-      } else {
-        // we are in a test, no queue
-      }
+static void _wake_fd_init() {
+#ifdef HAVE_SYS_EVENTFD_H
+  q.wake_fd = q.wake_wfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (q.wake_fd < 0) {
+    rb_sys_fail("eventfd(2)");
+  }
+#else
+  int fds[2];
+  if (pipe(fds)) {
+    rb_sys_fail("pipe(2)");
+  }
+  for (int i = 0; i < 2; i++) {
+    nyara_set_nonblock(fds[i]);
+    fcntl(fds[i], F_SETFD, FD_CLOEXEC);
+  }
+  q.wake_fd = fds[0];
+  q.wake_wfd = fds[1];
+#endif
+  ADD_E(q.wake_fd, WAKE_KEY, E_READ);
+}
+
+// pop expired timers, wake sleeping requests and sweep inactive ones
+static void _expire_timers() {
+  long now = _now_ms();
+  while (q.timers_size && q.timers[0].at <= now) {
+    Request* p = q.timers[0].request;
+    long at = _request_deadline(p);
+    if (at > now) {
+      // touched after scheduled
+      _timer_set(p, at);
+    } else if (p->sleeping) {
+      _wake_request(p);
+    } else {
+      nyara_detach_request(p);
+    }
+  }
+}
+
+// unregister and close the listener, after Ext.graceful_quit.
+// it is done here because the event queue is not thread safe (e.g. io_uring SQ ring)
+static void _stop_accept() {
+  int fd = q.tcp_server_fd;
+  if (fd < 0) {
+    return;
+  }
+  // CLOSE_E submits the io_uring removal now, DEL_E unregisters it for other backends
+  CLOSE_E(fd);
+  DEL_E(fd);
+  // closing our copy is enough for a reuse_port listener to leave the group, the shared one is kept by master
+  close(fd);
+  q.tcp_server_fd = -1;
+}
+
+// close kept-alive connections waiting for next request
+static void _sweep_idle() {
+  for (int i = 0; i < q.conns_capa; i++) {
+    Request* p = q.conns[i].request;
+    if (p && !p->sleeping && p->served && p->parse_state == PS_INIT) {
+      nyara_detach_request(p);
     }
+  }
+}
 
-    rb_ary_clear(q.to_resume_requests);
+// platform independent, invoked by LOOP_E()
+static void _loop_body(st_table* keys, int accept_sz) {
+  st_foreach(keys, _handle_request_cb, 0);
+
+  // accept, drain the listener by batches
+  if (accept_sz || q.accept_pending) {
+    _accept_requests(q.accept_batch);
   }
 
+  _expire_timers();
+
+  // execute other thread / interrupts
+  rb_thread_schedule();
+
+  // wakeup actions woken by other threads
+  _wake_requests();
+
   if (q.graceful_quit) {
-    if (RTEST(rb_funcall(q.rid_request_map, rb_intern("empty?"), 0))) {
+    _stop_accept();
+    _sweep_idle();
+    if (q.conns_size == 0) {
+      // ruby code after run_queue doesn't run
+      nyara_access_log_close();
       _Exit(0);
     }
   }
 }
 
-void nyara_detach_rid(VALUE rid) {
-  VALUE request = rb_hash_delete(q.rid_request_map, rid);
-  if (request != Qnil) {
-    Request* p;
-    Data_Get_Struct(request, Request, p);
-    VALUE* watched = RARRAY_PTR(p->watched_fds);
-    long watched_len = RARRAY_LEN(p->watched_fds);
-    for (long i = 0; i < watched_len; i++) {
-      close(NUM2INT(watched[i]));
-    }
-    if (p->fd) {
-      close(p->fd);
-      p->fd = 0;
+// remove request from the connection table and close its fds
+void nyara_detach_request(Request* p) {
+  if (p->fd && p->fd < q.conns_capa && q.conns[p->fd].request == p) {
+    q.conns[p->fd].request = NULL;
+    q.conns_size--;
+    nyara_score->conns = q.conns_size;
+    _set_sleeping(p, false);
+    _timer_remove(p);
+    p->out_len = 0;
+    p->term_pending = false;
+    if (p->watched_fds != Qnil) {
+      VALUE* watched = RARRAY_PTR(p->watched_fds);
+      long watched_len = RARRAY_LEN(p->watched_fds);
+      for (long i = 0; i < watched_len; i++) {
+        CLOSE_E(NUM2INT(watched[i]));
+        close(NUM2INT(watched[i]));
+      }
     }
+    CLOSE_E(p->fd);
+    close(p->fd);
+    p->fd = 0;
+    // wakeups of the finished request are dropped
+    p->gen++;
+    nyara_fiber_release(p);
+    nyara_request_recycle(p);
   }
 }
 
-static VALUE ext_init_queue(VALUE _) {
+// whether the connection can be kept alive after serving [served] requests
+bool nyara_keep_alive_p(long served) {
+  if (!q.fd) {
+    // we are in a test, one connection for one request
+    return false;
+  }
+  return !q.graceful_quit && served + 1 < q.keep_alive_max;
+}
+
+// init event queue with [backend], which is one of Ext.event_backends, or nil for the first one
+static VALUE ext_init_queue(VALUE _, VALUE v_backend) {
+  if (v_backend != Qnil) {
+    Check_Type(v_backend, T_STRING);
+#ifdef HAVE_LIBURING
+    use_uring = (strcmp(StringValueCStr(v_backend), "io_uring") == 0);
+#endif
+  }
   INIT_E();
+  _wake_fd_init();
   return Qnil;
 }
 
+// names of compiled event backends, the first one is the default
+static VALUE ext_event_backends(VALUE _) {
+  volatile VALUE backends = rb_ary_new();
+#ifdef HAVE_KQUEUE
+  rb_ary_push(backends, rb_str_new2("kqueue"));
+#else
+  rb_ary_push(backends, rb_str_new2("epoll"));
+#endif
+#ifdef HAVE_LIBURING
+  rb_ary_push(backends, rb_str_new2("io_uring"));
+#endif
+  return backends;
+}
+
 // run queue loop with server_fd
 static VALUE ext_run_queue(VALUE _, VALUE v_server_fd) {
   q.tcp_server_fd = FIX2INT(v_server_fd);
   nyara_set_nonblock(q.tcp_server_fd);
-  ADD_E(q.tcp_server_fd, sym_accept);
+  ADD_E(q.tcp_server_fd, ACCEPT_KEY, E_READ);
 
-  st_table* rids = st_init_numtable(); // to uniq rids for every round
+  st_table* keys = st_init_numtable(); // to uniq connection keys for every round
   int round_counter = 0;
 
   while (true) {
+    int accept_sz = SELECT_E(keys, _select_timeout());
+    nyara_score->loops++;
+    if (accept_sz || keys->num_entries) {
+      nyara_score->wakeups++;
+    }
+    _take_requeued(keys);
+    _loop_body(keys, accept_sz);
+    st_clear(keys);
+
     // in an edge-trigger system, there can be
-    // invoke full-loop body every 10 rounds
+    // loop some more rounds in case we miss some accepts
+    // todo change i according to worker number
     round_counter++;
     if (round_counter % 10 == 0) {
       round_counter = 0;
-      _loop_body_full();
-    } else {
-      int accept_sz = SELECT_E(rids);
-      _loop_body(rids, accept_sz);
-      st_clear(rids);
+      _accept_requests(q.accept_batch);
     }
   }
 
   return Qnil;
 }
 
-// set graceful quit flag and do not accept server_fd anymore
-static VALUE ext_graceful_quit(VALUE _, VALUE v_server_fd) {
+// set graceful quit flag, the loop stops accepting and closes the listener.
+// called in signal trap, so the loop thread is woken to do it
+static VALUE ext_graceful_quit(VALUE _) {
   q.graceful_quit = true;
-  int fd = FIX2INT(v_server_fd);
-  DEL_E(fd);
+  _wake_signal();
   return Qnil;
 }
 
@@ -326,31 +988,105 @@ static VALUE ext_set_inactive_timeout(VALUE _, VALUE v_timeout) {
   return Qnil;
 }
 
-// put request into sleep
-static VALUE ext_request_sleep(VALUE _, VALUE request) {
+// serve at most [max_requests] in a connection, and close it if idle for [timeout] seconds
+static VALUE ext_set_keep_alive(VALUE _, VALUE v_max_requests, VALUE v_timeout) {
+  q.keep_alive_max = NUM2INT(v_max_requests);
+  q.keep_alive_timeout = NUM2INT(v_timeout);
+  return Qnil;
+}
+
+// read at most [read_budget] bytes from a connection in a round, and let yield_if_over_budget yield after [cpu_budget] microseconds
+static VALUE ext_set_budget(VALUE _, VALUE v_read_budget, VALUE v_cpu_budget) {
+  q.read_budget = NUM2LONG(v_read_budget);
+  q.cpu_budget = NUM2LONG(v_cpu_budget);
+  return Qnil;
+}
+
+// yield to the event loop if current action has run longer than cpu budget,
+// it is resumed in the next round, after events of other connections are handled
+static VALUE ext_yield_if_over_budget(VALUE _) {
+  if (!q.fd || !q.cpu_budget || !q.curr_request || q.curr_request->fiber != rb_fiber_current()) {
+    return Qfalse;
+  }
+  if (_now_us() - q.resumed_at < q.cpu_budget) {
+    return Qfalse;
+  }
+  nyara_yield(sym_requeue);
+  return Qtrue;
+}
+
+// accept at most [batch] connections in a round of the event loop
+static VALUE ext_set_accept_batch(VALUE _, VALUE v_batch) {
+  q.accept_batch = NUM2INT(v_batch);
+  return Qnil;
+}
+
+// number of connections accepted by this worker
+static VALUE ext_accept_count(VALUE _) {
+  return ULL2NUM(nyara_score->accepts);
+}
+
+// number of event registration syscalls (epoll_ctl / kevent changes) in this worker
+static VALUE ext_event_ctl_count(VALUE _) {
+  return ULL2NUM(q.ctl_count);
+}
+
+// number of connections closed by client or broken, in this worker
+static VALUE ext_disconnect_count(VALUE _) {
+  return ULL2NUM(q.disconnect_count);
+}
+
+// number of actions cancelled because of client disconnect, in this worker
+static VALUE ext_cancel_count(VALUE _) {
+  return ULL2NUM(q.cancel_count);
+}
+
+// put request into sleep for [seconds], the action should `Fiber.yield :sleep` after this.
+// returns false without sleeping if a wakeup of this request came before
+static VALUE ext_request_sleep(VALUE _, VALUE request, VALUE v_seconds) {
   Request* p;
   Data_Get_Struct(request, Request, p);
 
-  p->sleeping = true;
+  if (p->wake_gen == p->gen) {
+    p->wake_gen = 0;
+    return Qfalse;
+  }
+  double seconds = NUM2DBL(v_seconds);
+  _set_sleeping(p, true);
+  p->wake_at = _now_ms() + (long)(seconds * 1000);
   if (!q.fd) {
     // we are in a test
-    return Qnil;
+    return Qtrue;
   }
 
-  VALUE* v_fds = RARRAY_PTR(p->watched_fds);
-  long v_fds_len = RARRAY_LEN(p->watched_fds);
-  for (long i = 0; i < v_fds_len; i++) {
-    DEL_E(FIX2INT(v_fds[i]));
-  }
-  DEL_E(p->fd);
-  return Qnil;
+  // fds stay registered, events during sleep are ignored by _handle_request
+  _timer_set(p, p->wake_at);
+  return Qtrue;
+}
+
+// generation of the request being served, for request_wakeup
+static VALUE ext_request_gen(VALUE _, VALUE request) {
+  Request* p;
+  Data_Get_Struct(request, Request, p);
+  return ULONG2NUM(p->gen);
 }
 
-// NOTE this will be executed in another thread, resuming fiber in a non-main thread will stuck
-static VALUE ext_request_wakeup(VALUE _, VALUE request) {
+// wake sleeping request of generation [v_gen] before the sleep timer expires, the request is resumed in the event loop.
+// if it is not sleeping yet, the wakeup is kept for its next sleep. returns false if the request is already reset.
+// NOTE usually called in another thread, resuming fiber in a non-main thread will stuck
+static VALUE ext_request_wakeup(VALUE _, VALUE request, VALUE v_gen) {
   // NOTE should not use curr_request
-  rb_ary_push(q.to_resume_requests, request);
-  return Qnil;
+  Request* p;
+  Data_Get_Struct(request, Request, p);
+  unsigned long gen = NUM2ULONG(v_gen);
+  if (gen != p->gen) {
+    return Qfalse;
+  }
+  p->wake_gen = gen;
+  if (_wake_push(p)) {
+    _wake_signal();
+  }
+  return Qtrue;
 }
 
 static VALUE ext_set_nonblock(VALUE _, VALUE v_fd) {
@@ -361,14 +1097,19 @@ static VALUE ext_set_nonblock(VALUE _, VALUE v_fd) {
 
 static VALUE ext_fd_watch(VALUE _, VALUE v_fd) {
   int fd = NUM2INT(v_fd);
+  if (q.curr_request->watched_fds == Qnil) {
+    q.curr_request->watched_fds = rb_ary_new();
+  }
   rb_ary_push(q.curr_request->watched_fds, v_fd);
-  ADD_E(fd, q.curr_request->rid);
+  ADD_E(fd, _conn_key(q.curr_request) | WATCHED_KEY_BIT, E_READ | E_WRITE);
   return Qnil;
 }
 
 static VALUE ext_fd_unwatch(VALUE _, VALUE v_fd) {
   int fd = NUM2INT(v_fd);
-  rb_ary_delete(q.curr_request->watched_fds, v_fd);
+  if (q.curr_request->watched_fds != Qnil) {
+    rb_ary_delete(q.curr_request->watched_fds, v_fd);
+  }
   DEL_E(fd);
   return Qnil;
 }
@@ -386,7 +1127,7 @@ static VALUE ext_fd_send(VALUE _, VALUE v_fd, VALUE v_data, VALUE v_flags) {
     long written = send(fd, buf, len, flags);
     if (written <= 0) {
       if (errno == EAGAIN || errno == EWOULDBLOCK) {
-        rb_fiber_yield(1, &sym_writing);
+        nyara_yield(sym_writing);
         continue;
       } else {
         rb_sys_fail("send(2)");
@@ -396,7 +1137,7 @@ static VALUE ext_fd_send(VALUE _, VALUE v_fd, VALUE v_data, VALUE v_flags) {
       buf += written;
       len -= written;
       if (len) {
-        rb_fiber_yield(1, &sym_writing);
+        nyara_yield(sym_writing);
       }
     }
   }
@@ -420,7 +1161,7 @@ static VALUE ext_fd_recv(VALUE _, VALUE v_fd, VALUE v_len, VALUE v_flags) {
     long recved = recv(fd, s, buf_len, flags);
     if (recved < 0) {
       if (errno == EAGAIN || errno == EWOULDBLOCK) {
-        rb_fiber_yield(1, &sym_reading);
+        nyara_yield(sym_reading);
         continue;
       } else {
         rb_sys_fail("recv(2)");
@@ -450,13 +1191,20 @@ static VALUE ext_handle_request(VALUE _, VALUE request) {
   Request* p;
   Data_Get_Struct(request, Request, p);
 
-  while (p->fiber == Qnil || rb_fiber_alive_p(p->fiber)) {
+  while (p->fd && !p->cancelled && !p->fiber_done && (p->fiber == Qnil || rb_fiber_alive_p(p->fiber))) {
     _handle_request(request);
     // stop if no more to read
     // NOTE this condition is sufficient to terminate handle, because
     // - there's no connect yield during test
     // - there's no view pause yield up to _handle_request
-    if (!p->sleeping) {
+    if (p->sleeping) {
+      long ms = p->wake_at - _now_ms();
+      if (ms > 0) {
+        struct timeval tv = {ms / 1000, (ms % 1000) * 1000};
+        rb_thread_wait_for(tv);
+      }
+      _set_sleeping(p, false);
+    } else {
       char buf[1];
       if (recv(p->fd, buf, 1, MSG_PEEK) <= 0) {
         break;
@@ -467,24 +1215,37 @@ static VALUE ext_handle_request(VALUE _, VALUE request) {
 }
 
 void Init_event(VALUE ext) {
-  q.rid_request_map = rb_hash_new();
-  rb_gc_register_mark_object(q.rid_request_map);
-  q.to_resume_requests = rb_ary_new();
-  rb_gc_register_mark_object(q.to_resume_requests);
+  // marks requests in the connection table
+  rb_gc_register_mark_object(Data_Wrap_Struct(rb_cObject, _conns_mark, NULL, &q));
+  q.fiber_pool = rb_ary_new();
+  rb_gc_register_mark_object(q.fiber_pool);
+  fiber_done_token = rb_obj_alloc(rb_cObject);
+  rb_gc_register_mark_object(fiber_done_token);
 
-  sym_accept = ID2SYM(rb_intern("accept"));
   sym_term_close = ID2SYM(rb_intern("term_close"));
   sym_writing = ID2SYM(rb_intern("writing"));
   sym_reading = ID2SYM(rb_intern("reading"));
   sym_sleep = ID2SYM(rb_intern("sleep"));
+  sym_cancel = ID2SYM(rb_intern("cancel"));
+  sym_requeue = ID2SYM(rb_intern("requeue"));
 
-  rb_define_singleton_method(ext, "init_queue", ext_init_queue, 0);
+  rb_define_singleton_method(ext, "init_queue", ext_init_queue, 1);
+  rb_define_singleton_method(ext, "event_backends", ext_event_backends, 0);
   rb_define_singleton_method(ext, "run_queue", ext_run_queue, 1);
-  rb_define_singleton_method(ext, "graceful_quit", ext_graceful_quit, 1);
+  rb_define_singleton_method(ext, "graceful_quit", ext_graceful_quit, 0);
   rb_define_singleton_method(ext, "set_inactive_timeout", ext_set_inactive_timeout, 1);
+  rb_define_singleton_method(ext, "set_keep_alive", ext_set_keep_alive, 2);
+  rb_define_singleton_method(ext, "set_accept_batch", ext_set_accept_batch, 1);
+  rb_define_singleton_method(ext, "set_budget", ext_set_budget, 2);
+  rb_define_singleton_method(ext, "yield_if_over_budget", ext_yield_if_over_budget, 0);
+  rb_define_singleton_method(ext, "accept_count", ext_accept_count, 0);
+  rb_define_singleton_method(ext, "event_ctl_count", ext_event_ctl_count, 0);
+  rb_define_singleton_method(ext, "disconnect_count", ext_disconnect_count, 0);
+  rb_define_singleton_method(ext, "cancel_count", ext_cancel_count, 0);
 
-  rb_define_singleton_method(ext, "request_sleep", ext_request_sleep, 1);
-  rb_define_singleton_method(ext, "request_wakeup", ext_request_wakeup, 1);
+  rb_define_singleton_method(ext, "request_sleep", ext_request_sleep, 2);
+  rb_define_singleton_method(ext, "request_gen", ext_request_gen, 1);
+  rb_define_singleton_method(ext, "request_wakeup", ext_request_wakeup, 2);
 
   // fd operations
   rb_define_singleton_method(ext, "set_nonblock", ext_set_nonblock, 1);
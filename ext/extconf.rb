@@ -49,7 +49,18 @@ have_epoll = have_func('epoll_create', 'sys/epoll.h')
 abort('no kqueue nor epoll') if !have_kqueue and !have_epoll
 $defs << "-DNDEBUG -D#{have_epoll ? 'HAVE_EPOLL' : 'HAVE_KQUEUE'}"
 
+# io_uring backend needs multishot accept (liburing >= 2.2), it can be switched off with --without-io_uring
+if have_epoll and with_config('io_uring', true) and have_library('uring', 'io_uring_prep_multishot_accept', 'liburing.h')
+  $defs << '-DHAVE_LIBURING'
+end
+
 have_func('rb_ary_new_capa', 'ruby.h')
+have_func('sched_setaffinity', 'sched.h')
+have_func('accept4', 'sys/socket.h')
+have_func('rb_thread_call_without_gvl', 'ruby/thread.h')
+have_header('sys/sendfile.h')
+have_header('sys/eventfd.h')
+have_library('pthread', 'pthread_create', 'pthread.h')
 
 tweak_include
 tweak_cflags
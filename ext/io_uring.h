@@ -0,0 +1,249 @@
+/* io_uring event adapter
+ *
+ * compiled along with epoll.h when liburing is found, and chosen at runtime by Ext.init_queue.
+ * registrations are queued as SQEs and submitted together with the wait, so a round costs one syscall.
+ * connections are watched by multishot polls with the same edge semantics as EPOLLET,
+ * and the listening fd by a multishot accept, whose accepted fds are taken by ACCEPT_E.
+ */
+
+#pragma once
+
+#include <liburing.h>
+
+#define URING_ENTRIES 4096
+
+// user_data of SQEs: tag | seq << 32 | fd
+#define URING_TAG_POLL   (1ULL << 60)
+#define URING_TAG_ACCEPT (1ULL << 61)
+#define URING_TAG_UPDATE (1ULL << 62)
+#define URING_TAG_CTL    (1ULL << 59)
+#define URING_SEQ_MASK 0xffffff
+#define URING_DATA(tag, fd, seq) ((tag) | ((uint64_t)((seq) & URING_SEQ_MASK) << 32) | (uint32_t)(fd))
+#define URING_FD(data) ((int)((data) & 0xffffffff))
+#define URING_SEQ(data) ((uint32_t)((data) >> 32) & URING_SEQ_MASK)
+
+typedef struct {
+  uint64_t key; // event data for the fd, 0 if not registered
+  int interest;
+  uint32_t seq; // increases on every registration, so completions of a removed poll don't count for a reused fd
+} UringEntry;
+
+static struct io_uring uring;
+static bool use_uring = false;
+static UringEntry* uring_entries = NULL; // fd => registration
+static int uring_entries_capa = 0;
+static int* uring_accepted = NULL; // fds from multishot accept, not taken yet
+static long uring_accepted_len = 0;
+static long uring_accepted_capa = 0;
+
+static UringEntry* _uring_entry(int fd) {
+  if (fd >= uring_entries_capa) {
+    int capa = uring_entries_capa ? uring_entries_capa : 1024;
+    while (capa <= fd) {
+      capa *= 2;
+    }
+    REALLOC_N(uring_entries, UringEntry, capa);
+    MEMZERO(uring_entries + uring_entries_capa, UringEntry, capa - uring_entries_capa);
+    uring_entries_capa = capa;
+  }
+  return uring_entries + fd;
+}
+
+static struct io_uring_sqe* _uring_sqe() {
+  struct io_uring_sqe* sqe = io_uring_get_sqe(&uring);
+  if (!sqe) {
+    // submission queue is full, flush it before the wait
+    q.ctl_count++;
+    io_uring_submit(&uring);
+    sqe = io_uring_get_sqe(&uring);
+    if (!sqe) {
+      rb_raise(rb_eRuntimeError, "io_uring submission queue full");
+    }
+  }
+  return sqe;
+}
+
+// poll(2) masks share values with epoll ones. POLLHUP and POLLERR are always reported
+static unsigned _uring_poll_mask(int interest) {
+  return ((interest & E_READ) ? EPOLLIN : 0) | ((interest & E_WRITE) ? EPOLLOUT : 0) | EPOLLRDHUP;
+}
+
+static void _uring_arm(int fd, UringEntry* e) {
+  struct io_uring_sqe* sqe = _uring_sqe();
+  if (e->key == ACCEPT_KEY) {
+    io_uring_prep_multishot_accept(sqe, fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    io_uring_sqe_set_data64(sqe, URING_DATA(URING_TAG_ACCEPT, fd, e->seq));
+  } else {
+    io_uring_prep_poll_multishot(sqe, fd, _uring_poll_mask(e->interest));
+    io_uring_sqe_set_data64(sqe, URING_DATA(URING_TAG_POLL, fd, e->seq));
+  }
+}
+
+static void URING_ADD_E(int fd, uint64_t key, int interest) {
+  UringEntry* e = _uring_entry(fd);
+  e->key = key;
+  e->interest = interest;
+  e->seq++;
+  _uring_arm(fd, e);
+}
+
+// like EPOLL_CTL_MOD, the updated poll is checked immediately
+static void URING_MOD_E(int fd, uint64_t key, int interest) {
+  UringEntry* e = _uring_entry(fd);
+  e->key = key;
+  e->interest = interest;
+  struct io_uring_sqe* sqe = _uring_sqe();
+  uint64_t data = URING_DATA(URING_TAG_POLL, fd, e->seq);
+  io_uring_prep_poll_update(sqe, data, data, _uring_poll_mask(interest), IORING_POLL_UPDATE_EVENTS);
+  io_uring_sqe_set_data64(sqe, URING_DATA(URING_TAG_UPDATE, fd, e->seq));
+}
+
+static void URING_DEL_E(int fd) {
+  if (fd >= uring_entries_capa || !uring_entries[fd].key) {
+    return;
+  }
+  UringEntry* e = uring_entries + fd;
+  struct io_uring_sqe* sqe = _uring_sqe();
+  if (e->key == ACCEPT_KEY) {
+    io_uring_prep_cancel64(sqe, URING_DATA(URING_TAG_ACCEPT, fd, e->seq), 0);
+  } else {
+    io_uring_prep_poll_remove(sqe, URING_DATA(URING_TAG_POLL, fd, e->seq));
+  }
+  io_uring_sqe_set_data64(sqe, URING_DATA(URING_TAG_CTL, fd, e->seq));
+  e->key = 0;
+}
+
+// polls hold the file, so the removal is submitted now, before the caller closes the fd.
+// completions already posted for it are dropped by seq in URING_SELECT_E
+static void URING_CLOSE_E(int fd) {
+  if (fd >= uring_entries_capa || !uring_entries[fd].key) {
+    return;
+  }
+  URING_DEL_E(fd);
+  q.ctl_count++;
+  io_uring_submit(&uring);
+}
+
+static void URING_INIT_E() {
+  int err = io_uring_queue_init(URING_ENTRIES, &uring, 0);
+  if (err < 0) {
+    errno = -err;
+    rb_sys_fail("io_uring_queue_init");
+  }
+  q.fd = uring.ring_fd;
+}
+
+typedef struct {
+  struct __kernel_timespec ts;
+  int err;
+} UringWait;
+
+static void* _uring_wait(void* data) {
+  UringWait* w = data;
+  struct io_uring_cqe* cqe;
+  w->err = io_uring_submit_and_wait_timeout(&uring, &cqe, 1, &w->ts, NULL);
+  return NULL;
+}
+
+static int URING_SELECT_E(st_table* keys, int timeout) {
+  struct io_uring_cqe* cqe;
+
+  // submit queued registrations and wait in one syscall
+  // timeout is capped by heart beat, so timers are checked
+  UringWait w = {{timeout / 1000, (timeout % 1000) * 1000 * 1000}, 0};
+  _wait_without_gvl(_uring_wait, &w);
+  int err = w.err;
+  if (err < 0 && err != -ETIME && err != -EINTR) {
+    errno = -err;
+    rb_sys_fail("io_uring_submit_and_wait_timeout");
+  }
+
+  int accept_sz = 0;
+  unsigned head;
+  unsigned seen = 0;
+  io_uring_for_each_cqe(&uring, head, cqe) {
+    seen++;
+    uint64_t data = io_uring_cqe_get_data64(cqe);
+    int fd = URING_FD(data);
+    bool more = cqe->flags & IORING_CQE_F_MORE;
+    UringEntry* e = (fd < uring_entries_capa ? uring_entries + fd : NULL);
+    // stale if the fd is unregistered, or registered again after this was submitted
+    bool live = (e && e->key && URING_SEQ(data) == (e->seq & URING_SEQ_MASK));
+
+    if (data & URING_TAG_ACCEPT) {
+      if (cqe->res >= 0) {
+        if (uring_accepted_len == uring_accepted_capa) {
+          uring_accepted_capa = uring_accepted_capa ? uring_accepted_capa * 2 : 64;
+          REALLOC_N(uring_accepted, int, uring_accepted_capa);
+        }
+        uring_accepted[uring_accepted_len++] = cqe->res;
+        accept_sz++;
+      }
+      if (!more && live && e->key == ACCEPT_KEY && cqe->res != -ECANCELED) {
+        _uring_arm(fd, e);
+      }
+
+    } else if (data & URING_TAG_POLL) {
+      if (!live || e->key == ACCEPT_KEY) {
+        // stale completion of a removed poll
+        continue;
+      }
+      if (cqe->res > 0) {
+        // same as epoll, EPOLLRDHUP alone is read till eof
+        _add_key(keys, e->key, cqe->res & (EPOLLHUP | EPOLLERR));
+      }
+      // multishot poll is terminated by the kernel (e.g. on overflow), re-arm it
+      if (!more && cqe->res != -ECANCELED) {
+        _uring_arm(fd, e);
+      }
+
+    } else if (data & URING_TAG_UPDATE) {
+      // the poll was terminated before update
+      if (cqe->res == -ENOENT && live) {
+        _uring_arm(fd, e);
+      }
+    }
+  }
+  io_uring_cq_advance(&uring, seen);
+
+  return accept_sz;
+}
+
+// take a connection accepted by multishot accept, -1 if none
+static int URING_ACCEPT_E(int server_fd) {
+  if (uring_accepted_len) {
+    return uring_accepted[--uring_accepted_len];
+  }
+  errno = EAGAIN;
+  return -1;
+}
+
+// dispatch to the backend chosen in Ext.init_queue
+
+static void ADD_E(int fd, uint64_t key, int interest) {
+  use_uring ? URING_ADD_E(fd, key, interest) : EPOLL_ADD_E(fd, key, interest);
+}
+
+static void MOD_E(int fd, uint64_t key, int interest) {
+  use_uring ? URING_MOD_E(fd, key, interest) : EPOLL_MOD_E(fd, key, interest);
+}
+
+static void DEL_E(int fd) {
+  use_uring ? URING_DEL_E(fd) : EPOLL_DEL_E(fd);
+}
+
+static void CLOSE_E(int fd) {
+  use_uring ? URING_CLOSE_E(fd) : EPOLL_CLOSE_E(fd);
+}
+
+static void INIT_E() {
+  use_uring ? URING_INIT_E() : EPOLL_INIT_E();
+}
+
+static int SELECT_E(st_table* keys, int timeout) {
+  return use_uring ? URING_SELECT_E(keys, timeout) : EPOLL_SELECT_E(keys, timeout);
+}
+
+static int ACCEPT_E(int server_fd) {
+  return use_uring ? URING_ACCEPT_E(server_fd) : EPOLL_ACCEPT_E(server_fd);
+}
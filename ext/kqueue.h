@@ -12,24 +12,32 @@
 
 static struct kevent qevents[MAX_E];
 
-static void ADD_E(int fd, VALUE rid) {
-  struct kevent e;
+static void _kevent_set(int fd, uint64_t key, int interest, int flags) {
+  struct kevent e[2];
   // without EV_CLEAR, it is level-triggered
   // http://www.cs.helsinki.fi/linux/linux-kernel/2001-38/0547.html
-  EV_SET(&e, fd, EVFILT_READ | EVFILT_WRITE, EV_ADD | EV_CLEAR, 0, 0, (void*)rid);
-  if (kevent(q.fd, &e, 1, NULL, 0, NULL))
+  EV_SET(&e[0], fd, EVFILT_READ, flags | EV_CLEAR | ((interest & E_READ) ? EV_ENABLE : EV_DISABLE), 0, 0, (void*)(uintptr_t)key);
+  EV_SET(&e[1], fd, EVFILT_WRITE, flags | EV_CLEAR | ((interest & E_WRITE) ? EV_ENABLE : EV_DISABLE), 0, 0, (void*)(uintptr_t)key);
+  q.ctl_count++;
+  if (kevent(q.fd, e, 2, NULL, 0, NULL))
     rb_sys_fail("kevent(2) - EV_ADD");
 }
 
-static void DEL_E_WITH_FILTER(int fd, int filter) {
-  struct kevent e;
-  EV_SET(&e, fd, filter, EV_DELETE, 0, 0, NULL);
-  if (kevent(q.fd, &e, 1, NULL, 0, NULL))
-    rb_sys_fail("kevent(2) - EV_DELETE");
+static void ADD_E(int fd, uint64_t key, int interest) {
+  _kevent_set(fd, key, interest, EV_ADD);
+}
+
+static void MOD_E(int fd, uint64_t key, int interest) {
+  _kevent_set(fd, key, interest, 0);
 }
 
 static void DEL_E(int fd) {
-  DEL_E_WITH_FILTER(fd, EVFILT_READ | EVFILT_WRITE);
+  struct kevent e[2];
+  EV_SET(&e[0], fd, EVFILT_READ, EV_DELETE, 0, 0, NULL);
+  EV_SET(&e[1], fd, EVFILT_WRITE, EV_DELETE, 0, 0, NULL);
+  q.ctl_count++;
+  if (kevent(q.fd, e, 2, NULL, 0, NULL))
+    rb_sys_fail("kevent(2) - EV_DELETE");
 }
 
 static void INIT_E() {
@@ -39,22 +47,44 @@ static void INIT_E() {
   }
 }
 
-static int SELECT_E(st_table* rids) {
-  static struct timespec ts = {0, 1000 * 1000 * 100};
+typedef struct {
+  struct timespec ts;
+  int sz;
+} KqueueWait;
+
+static void* _kqueue_wait(void* data) {
+  KqueueWait* w = data;
+  w->sz = kevent(q.fd, NULL, 0, qevents, MAX_E, &w->ts);
+  return NULL;
+}
 
-  // heart beat of 0.1 sec, allow ruby signal interrupts to be inserted
-  int sz = kevent(q.fd, NULL, 0, qevents, MAX_E, &ts);
+static int SELECT_E(st_table* keys, int timeout) {
+  // timeout is capped by heart beat, so timers are checked
+  KqueueWait w = {{timeout / 1000, (timeout % 1000) * 1000 * 1000}, 0};
+  _wait_without_gvl(_kqueue_wait, &w);
+  int sz = w.sz;
   int accept_sz = 0;
 
   for (int i = 0; i < sz; i++) {
-    if (qevents[i].filter & (EVFILT_READ | EVFILT_WRITE)) {
-      VALUE rid = (VALUE)qevents[i].udata;
-      if (rid == sym_accept) {
+    if (qevents[i].filter == EVFILT_READ || qevents[i].filter == EVFILT_WRITE) {
+      uint64_t key = (uint64_t)(uintptr_t)qevents[i].udata;
+      if (key == ACCEPT_KEY) {
         accept_sz++;
       } else {
-        st_insert(rids, rid, 0);
+        // EV_EOF of the read filter may be a half-closed client, data before the eof is still read and served.
+        // EV_EOF of the write filter means the response can not be sent
+        bool hangup = (qevents[i].flags & EV_ERROR) || (qevents[i].filter == EVFILT_WRITE && (qevents[i].flags & EV_EOF));
+        _add_key(keys, key, hangup);
       }
     }
   }
   return accept_sz;
 }
+
+static int ACCEPT_E(int server_fd) {
+  return nyara_accept(server_fd);
+}
+
+// NOTE closed fds are removed from the queue automatically
+static void CLOSE_E(int fd) {
+}
@@ -5,6 +5,11 @@
 #include <sys/socket.h>
 #include <sys/resource.h>
 #include <sys/fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#ifdef HAVE_SCHED_SETAFFINITY
+#include <sched.h>
+#endif
 #include "inc/rdtsc.h"
 
 rb_encoding* u8_encoding;
@@ -21,6 +26,60 @@ void nyara_set_nonblock(int fd) {
   }
 }
 
+// accept a connection which is non-blocking and close-on-exec, -1 if none
+int nyara_accept(int server_fd) {
+#ifdef HAVE_ACCEPT4
+  return accept4(server_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
+  int fd = accept(server_fd, NULL, NULL);
+  if (fd > 0) {
+    nyara_set_nonblock(fd);
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+  }
+  return fd;
+#endif
+}
+
+static void _setsockopt_int(int fd, int level, int name, int value, const char* desc) {
+  if (setsockopt(fd, level, name, &value, sizeof(value))) {
+    rb_sys_fail(desc);
+  }
+}
+
+// set listener options and re-listen with [backlog], options with value 0 are left untouched.
+// accepted sockets inherit TCP_NODELAY and buffer sizes from the listener, so no syscall is paid per connection.
+// TCP_DEFER_ACCEPT and TCP_FASTOPEN are ignored where not supported.
+static VALUE ext_tune_listener(VALUE _, VALUE v_fd, VALUE v_backlog, VALUE v_defer_accept, VALUE v_fastopen,
+                               VALUE v_nodelay, VALUE v_sndbuf, VALUE v_rcvbuf) {
+  int fd = NUM2INT(v_fd);
+  int n;
+
+  if ((n = NUM2INT(v_defer_accept))) {
+#ifdef TCP_DEFER_ACCEPT
+    _setsockopt_int(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, n, "setsockopt(2) - TCP_DEFER_ACCEPT");
+#endif
+  }
+  if ((n = NUM2INT(v_fastopen))) {
+#ifdef TCP_FASTOPEN
+    _setsockopt_int(fd, IPPROTO_TCP, TCP_FASTOPEN, n, "setsockopt(2) - TCP_FASTOPEN");
+#endif
+  }
+  if (RTEST(v_nodelay)) {
+    _setsockopt_int(fd, IPPROTO_TCP, TCP_NODELAY, 1, "setsockopt(2) - TCP_NODELAY");
+  }
+  if ((n = NUM2INT(v_sndbuf))) {
+    _setsockopt_int(fd, SOL_SOCKET, SO_SNDBUF, n, "setsockopt(2) - SO_SNDBUF");
+  }
+  if ((n = NUM2INT(v_rcvbuf))) {
+    _setsockopt_int(fd, SOL_SOCKET, SO_RCVBUF, n, "setsockopt(2) - SO_RCVBUF");
+  }
+
+  if (listen(fd, NUM2INT(v_backlog))) {
+    rb_sys_fail("listen(2)");
+  }
+  return Qnil;
+}
+
 static void set_fd_limit(int nofiles) {
   struct rlimit rlim;
   getrlimit (RLIMIT_NOFILE, &rlim);
@@ -32,6 +91,22 @@ static void set_fd_limit(int nofiles) {
   }
 }
 
+// pin current process to cpu, returns false if not supported
+static VALUE ext_set_cpu_affinity(VALUE _, VALUE v_cpu) {
+  int cpu = NUM2INT(v_cpu);
+# ifdef HAVE_SCHED_SETAFFINITY
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  if (sched_setaffinity(0, sizeof(set), &set)) {
+    rb_sys_fail("sched_setaffinity(2)");
+  }
+  return Qtrue;
+# else
+  return Qfalse;
+# endif
+}
+
 static unsigned long long last_rdtsc = 0;
 
 static VALUE ext_rdtsc_start(VALUE _) {
@@ -82,11 +157,17 @@ void Init_nyara() {
   VALUE ext = rb_define_module_under(nyara, "Ext");
   rb_define_singleton_method(ext, "rdtsc_start", ext_rdtsc_start, 0);
   rb_define_singleton_method(ext, "rdtsc", ext_rdtsc, 0);
+  rb_define_singleton_method(ext, "set_cpu_affinity", ext_set_cpu_affinity, 1);
+  rb_define_singleton_method(ext, "tune_listener", ext_tune_listener, 7);
 
   Init_accept(ext);
   Init_mime(ext);
   Init_request(nyara, ext);
   Init_request_parse(nyara, ext);
+  Init_part_decode(ext);
+  Init_scoreboard(ext);
+  Init_route_stats(ext);
+  Init_access_log(ext);
   Init_test_response(nyara);
   Init_event(ext);
   Init_route(nyara, ext);
@@ -17,7 +17,7 @@
 
 /* event.c */
 void Init_event(VALUE ext);
-void nyara_detach_rid(VALUE rid);
+bool nyara_keep_alive_p(long served);
 
 
 /* request_parse.c */
@@ -27,7 +27,8 @@ void Init_request_parse(VALUE nyara, VALUE ext);
 /* request.c */
 void Init_request(VALUE nyara, VALUE ext);
 void nyara_request_term_close(VALUE request);
-bool nyara_send_data(int fd, const char* s, long len);
+VALUE nyara_yield(VALUE state);
+extern VALUE nyara_cancelled_class;
 
 
 /* test_response.c */
@@ -45,6 +46,25 @@ void Init_accept(VALUE ext);
 VALUE ext_parse_accept_value(VALUE _, VALUE str);
 
 
+/* part_decode.c */
+enum { PART_PLAIN, PART_BASE64, PART_QP };
+
+typedef struct {
+  int mechanism;
+  int state;
+  unsigned long bits; // base64 sextets not yet decoded
+  char hex1;          // first hex char of a quoted-printable escape
+  bool padded;        // base64 reached '='
+} PartDecoder;
+
+typedef void (*nyara_decode_sink)(void* data, const char* s, long len);
+
+void Init_part_decode(VALUE ext);
+void nyara_part_decoder_init(PartDecoder*, const char* mechanism, long len);
+void nyara_part_decode(PartDecoder*, const char* s, long len, nyara_decode_sink, void* data);
+void nyara_part_decode_final(PartDecoder*, nyara_decode_sink, void* data);
+
+
 /* mime.c */
 void Init_mime(VALUE ext);
 VALUE ext_mime_match(VALUE _, VALUE request_accept, VALUE accept_mimes);
@@ -66,17 +86,55 @@ extern VALUE nyara_config_hash_class;
 
 
 /* route.c */
+#define MAX_ROUTE_ARGS 16
+
 typedef struct {
   VALUE controller;
-  VALUE args;
+  VALUE args[MAX_ROUTE_ARGS]; // action id and converted captures
+  int args_len;
   VALUE scope;
   VALUE format; // string, path extension or matched ext in config
+  long route_id; // see route_stats.c
 } RouteResult;
 
 extern void Init_route(VALUE nyara, VALUE ext);
 extern RouteResult nyara_lookup_route(enum http_method method_num, VALUE vpath, VALUE accept_arr);
 
 
+/* route_stats.c */
+void Init_route_stats(VALUE ext);
+long nyara_route_stats_add(VALUE label);
+void nyara_route_stats_clear();
+double nyara_ticks_per_sec();
+
+
+/* access_log.c */
+void Init_access_log(VALUE ext);
+void nyara_access_log_close();
+
+
+/* scoreboard.c */
+// counters of a worker, padded to cache lines so workers don't share one
+typedef struct {
+  pid_t pid;                       // owner worker, 0 if free
+  int reserved;
+  unsigned long long accepts;      // accepted connections
+  unsigned long long conns;        // active connections
+  unsigned long long sleeping;     // sleeping actions
+  unsigned long long bytes_in;     // read from connections
+  unsigned long long bytes_out;    // sent to connections
+  unsigned long long parse_errors; // malformed requests
+  unsigned long long eagain;       // reads / writes retried later for EAGAIN
+  unsigned long long wakeups;      // event waits returned with events
+  unsigned long long loops;        // event loop iterations
+  char padding[48];                // to 128 bytes
+} ScoreSlot;
+
+void Init_scoreboard(VALUE ext);
+extern ScoreSlot* nyara_score; // slot of current worker
+
+
 /* nyara.c */
 void nyara_set_nonblock(int fd);
+int nyara_accept(int server_fd);
 extern rb_encoding* u8_encoding;
@@ -0,0 +1,208 @@
+/* streaming base64 / quoted-printable decoders for multipart parts */
+
+#include "nyara.h"
+#include <strings.h>
+
+enum { QP_TEXT, QP_EQ, QP_HEX1, QP_EQ_CR };
+
+// 0..63 for base64 chars, 64 for '=', -1 for others (which are skipped like unpack('m'))
+static signed char b64_table[256];
+
+static int _hex_value(unsigned char c) {
+  if (c >= '0' && c <= '9') {
+    return c - '0';
+  } else if (c >= 'A' && c <= 'F') {
+    return c - 'A' + 10;
+  } else if (c >= 'a' && c <= 'f') {
+    return c - 'a' + 10;
+  } else {
+    return -1;
+  }
+}
+
+void nyara_part_decoder_init(PartDecoder* d, const char* mechanism, long len) {
+  if (len == 6 && strncasecmp(mechanism, "base64", 6) == 0) {
+    d->mechanism = PART_BASE64;
+  } else if (len == 16 && strncasecmp(mechanism, "quoted-printable", 16) == 0) {
+    d->mechanism = PART_QP;
+  } else {
+    d->mechanism = PART_PLAIN;
+  }
+  d->state = 0;
+  d->bits = 0;
+  d->hex1 = 0;
+  d->padded = false;
+}
+
+// decoded bytes are collected in a stack buffer and handed to sink in blocks
+#define DECODE_BUF_SIZE 4096
+#define EMIT(c) do {\
+    buf[buf_len++] = (c);\
+    if (buf_len == DECODE_BUF_SIZE) {\
+      sink(data, buf, buf_len);\
+      buf_len = 0;\
+    }\
+  } while (0)
+
+static void _decode_base64(PartDecoder* d, const unsigned char* s, long len, nyara_decode_sink sink, void* data) {
+  char buf[DECODE_BUF_SIZE];
+  long buf_len = 0;
+  // state: number of sextets in bits, data after padding is ignored
+  if (d->padded) {
+    return;
+  }
+  for (long i = 0; i < len; i++) {
+    int v = b64_table[s[i]];
+    if (v < 0) {
+      continue;
+    }
+    if (v == 64) {
+      d->padded = true;
+      break;
+    }
+    d->bits = (d->bits << 6) | v;
+    if (++d->state == 4) {
+      EMIT((char)(d->bits >> 16));
+      EMIT((char)(d->bits >> 8));
+      EMIT((char)d->bits);
+      d->state = 0;
+      d->bits = 0;
+    }
+  }
+  if (buf_len) {
+    sink(data, buf, buf_len);
+  }
+}
+
+static void _decode_qp(PartDecoder* d, const unsigned char* s, long len, nyara_decode_sink sink, void* data) {
+  char buf[DECODE_BUF_SIZE];
+  long buf_len = 0;
+  for (long i = 0; i < len; i++) {
+    unsigned char c = s[i];
+    int h;
+    switch (d->state) {
+      case QP_TEXT:
+        if (c == '=') {
+          d->state = QP_EQ;
+        } else {
+          EMIT(c);
+        }
+        break;
+
+      case QP_EQ:
+        if (_hex_value(c) >= 0) {
+          d->hex1 = c;
+          d->state = QP_HEX1;
+        } else if (c == '\r') {
+          d->state = QP_EQ_CR;
+        } else {
+          // not an escape, keep '=' and re-scan c
+          EMIT('=');
+          d->state = QP_TEXT;
+          i--;
+        }
+        break;
+
+      case QP_HEX1:
+        if ((h = _hex_value(c)) >= 0) {
+          EMIT((char)((_hex_value(d->hex1) << 4) | h));
+          d->state = QP_TEXT;
+        } else {
+          EMIT('=');
+          EMIT(d->hex1);
+          d->state = QP_TEXT;
+          i--;
+        }
+        break;
+
+      case QP_EQ_CR:
+        if (c == '\n') {
+          // soft line break
+        } else {
+          EMIT('=');
+          EMIT('\r');
+          i--;
+        }
+        d->state = QP_TEXT;
+        break;
+    }
+  }
+  if (buf_len) {
+    sink(data, buf, buf_len);
+  }
+}
+
+void nyara_part_decode(PartDecoder* d, const char* s, long len, nyara_decode_sink sink, void* data) {
+  switch (d->mechanism) {
+    case PART_BASE64:
+      _decode_base64(d, (const unsigned char*)s, len, sink, data);
+      break;
+    case PART_QP:
+      _decode_qp(d, (const unsigned char*)s, len, sink, data);
+      break;
+    default:
+      sink(data, s, len);
+  }
+}
+
+// flush the incomplete quantum / escape at the end of part
+void nyara_part_decode_final(PartDecoder* d, nyara_decode_sink sink, void* data) {
+  char buf[3];
+  long buf_len = 0;
+  if (d->mechanism == PART_BASE64) {
+    // same as unpack('m'): 2 sextets make 1 byte, 3 sextets make 2 bytes
+    if (d->state == 2) {
+      buf[buf_len++] = (char)(d->bits >> 4);
+    } else if (d->state == 3) {
+      buf[buf_len++] = (char)(d->bits >> 10);
+      buf[buf_len++] = (char)(d->bits >> 2);
+    }
+  } else if (d->mechanism == PART_QP) {
+    if (d->state == QP_EQ) {
+      buf[buf_len++] = '=';
+    } else if (d->state == QP_HEX1) {
+      buf[buf_len++] = '=';
+      buf[buf_len++] = d->hex1;
+    } else if (d->state == QP_EQ_CR) {
+      buf[buf_len++] = '=';
+      buf[buf_len++] = '\r';
+    }
+  }
+  d->state = 0;
+  d->bits = 0;
+  d->padded = false;
+  if (buf_len) {
+    sink(data, buf, buf_len);
+  }
+}
+
+static void _str_sink(void* data, const char* s, long len) {
+  rb_str_cat((VALUE)data, s, len);
+}
+
+// decode chunks as if they come from the multipart parser, for test and benchmark
+static VALUE ext_part_decode(VALUE _, VALUE mechanism, VALUE chunks) {
+  Check_Type(mechanism, T_STRING);
+  Check_Type(chunks, T_ARRAY);
+  PartDecoder d;
+  nyara_part_decoder_init(&d, RSTRING_PTR(mechanism), RSTRING_LEN(mechanism));
+  volatile VALUE res = rb_str_new("", 0);
+  for (long i = 0; i < RARRAY_LEN(chunks); i++) {
+    VALUE chunk = RARRAY_PTR(chunks)[i];
+    Check_Type(chunk, T_STRING);
+    nyara_part_decode(&d, RSTRING_PTR(chunk), RSTRING_LEN(chunk), _str_sink, (void*)res);
+  }
+  nyara_part_decode_final(&d, _str_sink, (void*)res);
+  return res;
+}
+
+void Init_part_decode(VALUE ext) {
+  const char* chars = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+  memset(b64_table, -1, sizeof(b64_table));
+  for (int i = 0; i < 64; i++) {
+    b64_table[(unsigned char)chars[i]] = i;
+  }
+  b64_table['='] = 64;
+
+  rb_define_singleton_method(ext, "part_decode", ext_part_decode, 2);
+}
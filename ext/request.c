@@ -2,13 +2,39 @@
 
 #include "nyara.h"
 #include "request.h"
+#include "inc/rdtsc.h"
 #include <sys/time.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/socket.h>
+#ifdef HAVE_SYS_SENDFILE_H
+# include <sys/sendfile.h>
+#endif
+#ifndef IOV_MAX
+# define IOV_MAX 1024
+#endif
+#ifndef MSG_MORE
+# define MSG_MORE 0
+#endif
+
+// max number of detached requests kept for reuse in a worker
+#define REQUEST_POOL_MAX 1024
+
+// output smaller than this is buffered until flush
+#define OUT_BUF_THRESHOLD 16384
+// when more than this is pending, the action is suspended until the socket is writable
+#define OUT_BUF_HIGH_WATER 262144
 
 static VALUE str_html;
 static VALUE request_class;
+static VALUE request_pool; // [request], detached and ready for new connections
 static VALUE sym_reading;
 static VALUE sym_writing;
+static VALUE sym_cancel;
+VALUE nyara_cancelled_class;
 static VALUE str_transfer_encoding;
+static VALUE str_content_length;
+static ID id_aref;
 
 #define P \
   Request* p;\
@@ -29,6 +55,7 @@ static void request_mark(void* pp) {
     rb_gc_mark_maybe(p->last_value);
     rb_gc_mark_maybe(p->last_part);
     rb_gc_mark_maybe(p->body);
+    rb_gc_mark_maybe(p->pipelined);
 
     rb_gc_mark_maybe(p->cookie);
     rb_gc_mark_maybe(p->session);
@@ -39,6 +66,10 @@ static void request_mark(void* pp) {
     rb_gc_mark_maybe(p->response_header_extra_lines);
     rb_gc_mark_maybe(p->watched_fds);
     rb_gc_mark_maybe(p->instance);
+    for (int i = 0; i < p->route_args_len; i++) {
+      rb_gc_mark_maybe(p->route_args[i]);
+    }
+    rb_gc_mark_maybe(p->part_data);
   }
 }
 
@@ -46,43 +77,69 @@ static void request_free(void* pp) {
   Request* p = pp;
   if (p) {
     if (p->fd) {
-      nyara_detach_rid(p->rid);
+      // being freed, keep it and its fiber out of pools
+      p->fiber_done = false;
+      p->fiber = Qfalse;
+      nyara_detach_request(p);
     }
     if (p->mparser) {
       multipart_parser_free(p->mparser);
       p->mparser = NULL;
     }
+    if (p->out_buf) {
+      xfree(p->out_buf);
+    }
+    if (p->hbuf) {
+      xfree(p->hbuf);
+    }
+    if (p->hspans) {
+      xfree(p->hspans);
+    }
+    if (p->part_buf) {
+      xfree(p->part_buf);
+    }
     xfree(p);
   }
 }
 
-static Request* _request_alloc() {
-  static int curr_rid = 1;
+// (re)initialize per-request fields, connection fields are kept
+static void _request_reset(Request* p) {
+  // a finished action fiber goes back to the pool
+  nyara_fiber_release(p);
 
-  Request* p = ALLOC(Request);
   http_parser_init(&(p->hparser), HTTP_REQUEST);
-  p->mparser = NULL;
+  if (p->mparser) {
+    multipart_parser_free(p->mparser);
+    p->mparser = NULL;
+  }
 
   p->method = HTTP_GET;
-  p->fd = 0;
   p->parse_state = 0;
   p->status = 200;
+  p->route_args_len = 0;
+  p->route_id = -1;
+  p->sent_bytes = 0;
+  memset(p->phases, 0, sizeof(p->phases));
+  p->phases[PH_ACCEPT] = rdtsc();
 
-  volatile VALUE header = rb_class_new_instance(0, NULL, nyara_header_hash_class);
   volatile VALUE path = rb_enc_str_new("", 0, u8_encoding);
-  volatile VALUE query = rb_class_new_instance(0, NULL, nyara_param_hash_class);
-  p->header = header;
+  p->header = Qnil;
+  p->hbuf_len = 0;
+  p->hspans_len = 0;
   p->accept = Qnil;
   p->format = Qnil;
   p->fiber = Qnil;
   p->scope = Qnil;
   p->path_with_query = Qnil;
   p->path = path;
-  p->query = query;
+  p->query = Qnil; // created when query string is parsed or requested
   p->last_field = Qnil;
   p->last_value = Qnil;
   p->last_part = Qnil;
   p->body = Qnil;
+  p->part_data = Qnil;
+  p->part_fd = -1;
+  p->part_buf_len = 0;
 
   p->cookie = Qnil;
   p->session = Qnil;
@@ -92,40 +149,144 @@ static Request* _request_alloc() {
   p->response_header = Qnil;
   p->response_header_extra_lines = Qnil;
 
-  volatile VALUE watched_fds = rb_ary_new();
-  p->watched_fds = watched_fds;
+  p->watched_fds = Qnil; // created by the first Ext.request_watch
   p->instance = Qnil;
 
+  p->yielded = Qnil;
+  p->gen++;
+  p->wake_gen = 0;
   p->sleeping = false;
+  p->cancelled = false;
+  p->streaming = false;
+  p->keep_alive = false;
+}
+
+// (re)initialize connection fields, buffers are kept
+static void _request_reset_conn(Request* p) {
+  p->pipelined = Qnil;
+  p->served = 0;
+  p->wake_at = 0;
+  p->timer_index = -1;
+  p->wake_next = NULL;
+  p->wake_queued = 0;
+  p->interest = 0;
+  p->out_len = 0;
+  p->term_pending = false;
+}
+
+static Request* _request_alloc() {
+  Request* p = ALLOC(Request);
+  p->mparser = NULL;
+  p->fd = 0;
+  p->fiber = Qnil;
+  p->fiber_done = false;
+  p->gen = 0;
+  _request_reset_conn(p);
+  p->out_buf = NULL;
+  p->out_capa = 0;
+  p->hbuf = NULL;
+  p->hbuf_capa = 0;
+  p->hspans = NULL;
+  p->hspans_capa = 0;
+  p->part_buf = NULL;
+  _request_reset(p);
   nyara_request_touch(p);
 
   p->self = Data_Wrap_Struct(request_class, request_mark, request_free, p);
-  p->rid = INT2FIX(curr_rid++); // todo synchronize?
 
   return p;
 }
 
+static void _request_clear_ivars(VALUE self);
+
+// take a request from pool, or allocate a new one
 Request* nyara_request_new(int fd) {
-  Request* p = _request_alloc();
+  Request* p;
+  if (RARRAY_LEN(request_pool)) {
+    VALUE self = rb_ary_pop(request_pool);
+    Data_Get_Struct(self, Request, p);
+    _request_reset_conn(p);
+    _request_reset(p);
+    _request_clear_ivars(self);
+    nyara_request_touch(p);
+  } else {
+    p = _request_alloc();
+  }
   p->fd = fd;
   return p;
 }
 
-void nyara_request_term_close(VALUE self) {
-  P;
+// put a detached request into pool, unless an action is still running in it
+void nyara_request_recycle(Request* p) {
+  if (p->fiber == Qnil && !p->wake_queued && RARRAY_LEN(request_pool) < REQUEST_POOL_MAX) {
+    rb_ary_push(request_pool, p->self);
+  }
+}
+
+// response is framed if chunked terminator is sent or Content-Length is given,
+// so the client can tell where it ends without connection close
+static bool _response_framed(Request* p) {
+  if (TYPE(p->response_header) != T_HASH || !OBJ_FROZEN(p->response_header)) {
+    // header not sent
+    return false;
+  }
   VALUE transfer_enc = rb_hash_aref(p->response_header, str_transfer_encoding);
-  if (TYPE(transfer_enc) == T_STRING) {
-    if (RSTRING_LEN(transfer_enc) == 7) {
-      if (strncmp(RSTRING_PTR(transfer_enc), "chunked", 7) == 0) {
-        // usually this succeeds, while not, it doesn't matter cause we are closing it
-        if (write(p->fd, "0\r\n\r\n", 5)) {
-        }
-      }
+  if (TYPE(transfer_enc) == T_STRING && RSTRING_LEN(transfer_enc) == 7) {
+    if (strncmp(RSTRING_PTR(transfer_enc), "chunked", 7) == 0) {
+      // usually this succeeds, while not, it doesn't matter cause we are closing it
+      return write(p->fd, "0\r\n\r\n", 5) == 5;
     }
   }
-  if (p->fd) {
-    nyara_detach_rid(p->rid);
+  VALUE content_len = rb_hash_aref(p->response_header, str_content_length);
+  return TYPE(content_len) == T_STRING && RSTRING_LEN(content_len);
+}
+
+static int _ivar_found(ID name, VALUE val, st_data_t found) {
+  *(bool*)found = true;
+  return ST_STOP;
+}
+
+// clear memoized values like @param, @domain
+static void _request_clear_ivars(VALUE self) {
+  bool found = false;
+  rb_ivar_foreach(self, _ivar_found, (st_data_t)&found);
+  if (!found) {
+    return;
+  }
+  volatile VALUE ivars = rb_obj_instance_variables(self);
+  long len = RARRAY_LEN(ivars);
+  for (long i = 0; i < len; i++) {
+    rb_obj_remove_instance_variable(self, RARRAY_PTR(ivars)[i]);
+  }
+}
+
+void nyara_request_term_close(VALUE self) {
+  P;
+  if (!p->fd) {
+    return;
+  }
+
+  p->phases[PH_CLOSE] = rdtsc();
+  nyara_route_stats_record(p);
+  nyara_access_log_push(p);
+
+  bool framed = _response_framed(p);
+  if (!framed || !p->keep_alive || p->parse_state != PS_MESSAGE_COMPLETE) {
+    nyara_detach_request(p);
+    return;
+  }
+
+  // keep alive: reuse request and fd, the fd stays in the event queue
+  if (p->watched_fds != Qnil) {
+    VALUE* watched = RARRAY_PTR(p->watched_fds);
+    long watched_len = RARRAY_LEN(p->watched_fds);
+    for (long i = 0; i < watched_len; i++) {
+      close(NUM2INT(watched[i]));
+    }
   }
+  p->served++;
+  _request_reset(p);
+  _request_clear_ivars(self);
 }
 
 void nyara_request_touch(Request* p) {
@@ -141,11 +302,105 @@ static VALUE request_http_method(VALUE self) {
   return rb_enc_str_new(str, strlen(str), u8_encoding);
 }
 
+// called by parser, a new header line starts when a field comes after a value
+void nyara_request_header_append(Request* p, bool is_value, const char* s, long len) {
+  HeaderSpan* span = (p->hspans_len ? p->hspans + p->hspans_len - 1 : NULL);
+  if (!is_value && (!span || span->value >= 0)) {
+    if (p->hspans_len == p->hspans_capa) {
+      p->hspans_capa = p->hspans_capa ? p->hspans_capa * 2 : 16;
+      REALLOC_N(p->hspans, HeaderSpan, p->hspans_capa);
+    }
+    span = p->hspans + p->hspans_len++;
+    span->field = p->hbuf_len;
+    span->field_len = 0;
+    span->value = -1;
+    span->value_len = 0;
+  }
+
+  if (p->hbuf_len + len > p->hbuf_capa) {
+    long capa = p->hbuf_capa ? p->hbuf_capa : 1024;
+    while (capa < p->hbuf_len + len) {
+      capa *= 2;
+    }
+    REALLOC_N(p->hbuf, char, capa);
+    p->hbuf_capa = capa;
+  }
+  memcpy(p->hbuf + p->hbuf_len, s, len);
+
+  if (is_value) {
+    if (span->value < 0) {
+      span->value = p->hbuf_len;
+    }
+    span->value_len += len;
+  } else {
+    span->field_len += len;
+  }
+  p->hbuf_len += len;
+}
+
+static bool _field_eq(const char* a, const char* b, long len) {
+  for (long i = 0; i < len; i++) {
+    char x = a[i];
+    char y = b[i];
+    if (x >= 'A' && x <= 'Z') {
+      x += 'a' - 'A';
+    }
+    if (y >= 'A' && y <= 'Z') {
+      y += 'a' - 'A';
+    }
+    if (x != y) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// find header value in the raw header, the last one wins like the materialized hash.
+// returns NULL if not found
+const char* nyara_request_header_value(Request* p, const char* field, long field_len, long* value_len) {
+  for (long i = p->hspans_len - 1; i >= 0; i--) {
+    HeaderSpan* span = p->hspans + i;
+    if (span->value >= 0 && span->field_len == field_len && _field_eq(p->hbuf + span->field, field, field_len)) {
+      *value_len = span->value_len;
+      return p->hbuf + span->value;
+    }
+  }
+  return NULL;
+}
+
 static VALUE request_header(VALUE self) {
   P;
+  if (p->header == Qnil) {
+    volatile VALUE header = rb_class_new_instance(0, NULL, nyara_header_hash_class);
+    for (long i = 0; i < p->hspans_len; i++) {
+      HeaderSpan* span = p->hspans + i;
+      if (span->value < 0) {
+        continue;
+      }
+      volatile VALUE field = rb_enc_str_new(p->hbuf + span->field, span->field_len, u8_encoding);
+      nyara_headerlize(field);
+      rb_hash_aset(header, field, rb_enc_str_new(p->hbuf + span->value, span->value_len, u8_encoding));
+    }
+    p->header = header;
+  }
   return p->header;
 }
 
+// lookup a header value without materializing all headers
+static VALUE request_header_value(VALUE self, VALUE field) {
+  P;
+  if (p->header != Qnil) {
+    return rb_funcall(p->header, id_aref, 1, field);
+  }
+  if (TYPE(field) == T_SYMBOL) {
+    field = rb_sym_to_s(field);
+  }
+  Check_Type(field, T_STRING);
+  long len;
+  const char* s = nyara_request_header_value(p, RSTRING_PTR(field), RSTRING_LEN(field), &len);
+  return s ? rb_enc_str_new(s, len, u8_encoding) : Qnil;
+}
+
 static VALUE request_scope(VALUE self) {
   P;
   return p->scope;
@@ -158,6 +413,9 @@ static VALUE request_path(VALUE self) {
 
 static VALUE request_query(VALUE self) {
   P;
+  if (p->query == Qnil) {
+    p->query = rb_class_new_instance(0, NULL, nyara_param_hash_class);
+  }
   return p->query;
 }
 
@@ -207,14 +465,87 @@ static VALUE request_flash_eq(VALUE self, VALUE flash) {
   return p->flash = flash;
 }
 
+// yield to the event loop, raises Nyara::Cancelled if the client disconnected meanwhile.
+// all yield points of the action fiber should go through this
+VALUE nyara_yield(VALUE state) {
+  VALUE res = rb_fiber_yield(1, &state);
+  if (res == sym_cancel) {
+    rb_raise(nyara_cancelled_class, "client disconnected");
+  }
+  return res;
+}
+
+static VALUE ext_fiber_yield(VALUE _, VALUE state) {
+  return nyara_yield(state);
+}
+
+// read all the message, if the body was streamed, returns the part not consumed yet
 static VALUE request_body(VALUE self) {
   P;
+  p->streaming = false;
   while (p->parse_state != PS_MESSAGE_COMPLETE) {
-    rb_fiber_yield(1, &sym_reading);
+    nyara_yield(sym_reading);
   }
   return p->body;
 }
 
+// whether a streamed chunk or part is received but not consumed by the action.
+// event.c stops reading the connection in this case
+bool nyara_request_body_pending(Request* p) {
+  if (!p->streaming || p->body == Qnil) {
+    return false;
+  }
+  if (TYPE(p->body) == T_ARRAY) {
+    return RARRAY_LEN(p->body) > 0;
+  } else {
+    return RSTRING_LEN(p->body) > 0;
+  }
+}
+
+// next chunk of body data, or nil when the message completes.
+// after this, body data is handed out instead of accumulated
+static VALUE request_read_body_chunk(VALUE self) {
+  P;
+  if (TYPE(p->body) != T_STRING) {
+    rb_raise(rb_eRuntimeError, "multipart body should be read with each_part");
+  }
+  p->streaming = true;
+  while (true) {
+    if (RSTRING_LEN(p->body)) {
+      volatile VALUE chunk = p->body;
+      p->body = rb_enc_str_new("", 0, u8_encoding);
+      return chunk;
+    }
+    if (p->parse_state == PS_MESSAGE_COMPLETE) {
+      return Qnil;
+    }
+    nyara_yield(sym_reading);
+  }
+}
+
+// next completed part of multipart body, or nil when the message completes
+static VALUE request_read_part(VALUE self) {
+  P;
+  if (TYPE(p->body) != T_ARRAY) {
+    rb_raise(rb_eRuntimeError, "body is not multipart");
+  }
+  p->streaming = true;
+  while (true) {
+    if (RARRAY_LEN(p->body)) {
+      return rb_ary_shift(p->body);
+    }
+    if (p->parse_state == PS_MESSAGE_COMPLETE) {
+      return Qnil;
+    }
+    nyara_yield(sym_reading);
+  }
+}
+
+static VALUE request_keep_alive_p(VALUE self) {
+  P;
+  return p->keep_alive ? Qtrue : Qfalse;
+}
+
 static VALUE request_message_complete_p(VALUE self) {
   P;
   return (p->parse_state == PS_MESSAGE_COMPLETE) ? Qtrue : Qfalse;
@@ -252,32 +583,169 @@ static VALUE ext_request_set_status(VALUE _, VALUE self, VALUE n) {
   return n;
 }
 
-// return true if success
-bool nyara_send_data(int fd, const char* buf, long len) {
-  while(len) {
-    long written = write(fd, buf, len);
-    if (written <= 0) {
-      if (errno == EAGAIN || errno == EWOULDBLOCK) {
-        rb_fiber_yield(1, &sym_writing);
-      } else {
-        return false;
-      }
-    } else {
-      buf += written;
-      len -= written;
-      if (len) {
-        rb_fiber_yield(1, &sym_writing);
+// send without blocking, returns bytes sent, 0 if socket buffer is full, -1 on error
+static long _send_iov(int fd, struct iovec* iov, int iovcnt, int flags) {
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = iov;
+  msg.msg_iovlen = (iovcnt > IOV_MAX ? IOV_MAX : iovcnt);
+  long sent = sendmsg(fd, &msg, flags);
+  if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+    nyara_score->eagain++;
+    return 0;
+  }
+  if (sent > 0) {
+    nyara_score->bytes_out += sent;
+  }
+  return sent;
+}
+
+static void _out_append(Request* p, const char* s, long len) {
+  if (p->out_len + len > p->out_capa) {
+    long capa = p->out_capa ? p->out_capa : 4096;
+    while (capa < p->out_len + len) {
+      capa *= 2;
+    }
+    REALLOC_N(p->out_buf, char, capa);
+    p->out_capa = capa;
+  }
+  memcpy(p->out_buf + p->out_len, s, len);
+  p->out_len += len;
+}
+
+// send buffered output, if [wait], yields :writing until all is sent (must be called in the action fiber).
+// return false if connection is broken, and buffered output is discarded
+static bool _flush(Request* p, bool wait, int flags) {
+  if (p->cancelled) {
+    p->out_len = 0;
+    return false;
+  }
+  while (p->out_len) {
+    struct iovec iov = {p->out_buf, p->out_len};
+    long sent = _send_iov(p->fd, &iov, 1, flags);
+    if (sent < 0) {
+      p->out_len = 0;
+      return false;
+    }
+    p->out_len -= sent;
+    if (p->out_len) {
+      memmove(p->out_buf, p->out_buf + sent, p->out_len);
+      if (!wait) {
+        break;
       }
+      nyara_yield(sym_writing);
     }
   }
   return true;
 }
 
+// send as much buffered output as the socket can take, the rest is left for the next writable event
+bool nyara_request_flush(Request* p) {
+  return _flush(p, false, 0);
+}
+
+// buffer output until it exceeds OUT_BUF_THRESHOLD, then send it with buffered data in one syscall.
+// if the socket can not take it, at most OUT_BUF_HIGH_WATER bytes are kept in buffer,
+// and the action is suspended until the rest is sent.
+// return false if connection is broken
+bool nyara_request_write(Request* p, struct iovec* iov, int iovcnt) {
+  if (p->cancelled) {
+    rb_raise(nyara_cancelled_class, "client disconnected");
+  }
+  if (!p->phases[PH_HEADERS_SENT]) {
+    p->phases[PH_HEADERS_SENT] = rdtsc();
+  }
+  long total = p->out_len;
+  for (int i = 0; i < iovcnt; i++) {
+    total += iov[i].iov_len;
+  }
+  p->sent_bytes += total - p->out_len;
+  if (total <= OUT_BUF_THRESHOLD) {
+    for (int i = 0; i < iovcnt; i++) {
+      _out_append(p, iov[i].iov_base, iov[i].iov_len);
+    }
+    return true;
+  }
+
+  volatile VALUE tmp;
+  struct iovec* vec = ALLOCV_N(struct iovec, tmp, iovcnt + 1);
+  int cnt = 0;
+  if (p->out_len) {
+    vec[cnt].iov_base = p->out_buf;
+    vec[cnt].iov_len = p->out_len;
+    cnt++;
+    // the buffer is owned by vec until sent, so flushes from event loop won't send it twice
+    p->out_len = 0;
+  }
+  for (int i = 0; i < iovcnt; i++) {
+    if (iov[i].iov_len) {
+      vec[cnt++] = iov[i];
+    }
+  }
+
+  bool success = true;
+  struct iovec* v = vec;
+  while (true) {
+    long sent = _send_iov(p->fd, v, cnt, 0);
+    if (sent < 0) {
+      success = false;
+      break;
+    }
+    total -= sent;
+    while (cnt && (size_t)sent >= v->iov_len) {
+      sent -= v->iov_len;
+      v++;
+      cnt--;
+    }
+    if (cnt) {
+      v->iov_base = (char*)v->iov_base + sent;
+      v->iov_len -= sent;
+    }
+
+    if (total <= OUT_BUF_HIGH_WATER) {
+      // keep the rest, only the first one can be inside out_buf
+      for (int i = 0; i < cnt; i++) {
+        char* base = v[i].iov_base;
+        if (base >= p->out_buf && base < p->out_buf + p->out_capa) {
+          memmove(p->out_buf, base, v[i].iov_len);
+          p->out_len = v[i].iov_len;
+        } else {
+          _out_append(p, base, v[i].iov_len);
+        }
+      }
+      break;
+    }
+    nyara_yield(sym_writing);
+  }
+
+  ALLOCV_END(tmp);
+  return success;
+}
+
+// data can be a string or an array of strings, the latter is sent with one syscall
 static VALUE ext_request_send_data(VALUE _, VALUE self, VALUE data) {
   P;
-  char* buf = RSTRING_PTR(data);
-  long len = RSTRING_LEN(data);
-  nyara_send_data(p->fd, buf, len);
+  if (TYPE(data) != T_ARRAY) {
+    struct iovec iov = {RSTRING_PTR(data), RSTRING_LEN(data)};
+    nyara_request_write(p, &iov, 1);
+    return Qnil;
+  }
+
+  long len = RARRAY_LEN(data);
+  volatile VALUE tmp;
+  struct iovec* iov = ALLOCV_N(struct iovec, tmp, len);
+  int iovcnt = 0;
+  for (long i = 0; i < len; i++) {
+    VALUE s = RARRAY_PTR(data)[i];
+    Check_Type(s, T_STRING);
+    if (RSTRING_LEN(s)) {
+      iov[iovcnt].iov_base = RSTRING_PTR(s);
+      iov[iovcnt].iov_len = RSTRING_LEN(s);
+      iovcnt++;
+    }
+  }
+  nyara_request_write(p, iov, iovcnt);
+  ALLOCV_END(tmp);
   return Qnil;
 }
 
@@ -293,18 +761,83 @@ static VALUE ext_request_send_chunk(VALUE _, VALUE self, VALUE str) {
   if (pre_len <= 0) {
     rb_raise(rb_eRuntimeError, "fail to format chunk length for len: %ld", len);
   }
-  bool success = \
-    nyara_send_data(p->fd, pre_buf, pre_len) &&
-    nyara_send_data(p->fd, RSTRING_PTR(str), len) &&
-    nyara_send_data(p->fd, "\r\n", 2);
-
-  if (!success) {
+  struct iovec iov[] = {
+    {pre_buf, pre_len},
+    {RSTRING_PTR(str), len},
+    {(char*)"\r\n", 2}
+  };
+  if (!nyara_request_write(p, iov, 3)) {
     rb_sys_fail("write(2)");
   }
 
   return Qnil;
 }
 
+// invoke the matched action of controller instance with converted captures
+static VALUE ext_request_invoke_action(VALUE _, VALUE self) {
+  P;
+  if (!p->route_args_len || p->instance == Qnil) {
+    rb_raise(rb_eRuntimeError, "no action matched");
+  }
+  return rb_funcall2(p->instance, SYM2ID(p->route_args[0]), p->route_args_len - 1, p->route_args + 1);
+}
+
+// send all buffered output now, suspends the action until it is done
+static VALUE ext_request_flush(VALUE _, VALUE self) {
+  P;
+  if (!_flush(p, true, 0)) {
+    rb_sys_fail("send(2)");
+  }
+  return Qnil;
+}
+
+// send [len] bytes of file [in_fd] from [offset], without copying file content into ruby strings
+static VALUE ext_request_send_file(VALUE _, VALUE self, VALUE v_in_fd, VALUE v_offset, VALUE v_len) {
+  P;
+  int in_fd = NUM2INT(v_in_fd);
+  off_t offset = NUM2OFFT(v_offset);
+  long len = NUM2LONG(v_len);
+
+#ifdef HAVE_SYS_SENDFILE_H
+  // header goes out in the same segment with file head
+  if (!_flush(p, true, (len ? MSG_MORE : 0))) {
+    rb_sys_fail("send(2)");
+  }
+#endif
+
+  while (len > 0) {
+#ifdef HAVE_SYS_SENDFILE_H
+    long sent = sendfile(p->fd, in_fd, &offset, len);
+    if (sent < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        nyara_score->eagain++;
+        nyara_yield(sym_writing);
+        continue;
+      }
+      rb_sys_fail("sendfile(2)");
+    }
+    nyara_score->bytes_out += sent;
+    p->sent_bytes += sent;
+#else
+    char buf[16384];
+    long sent = pread(in_fd, buf, (len < (long)sizeof(buf) ? len : (long)sizeof(buf)), offset);
+    if (sent < 0) {
+      rb_sys_fail("pread(2)");
+    }
+    struct iovec iov = {buf, sent};
+    if (sent && !nyara_request_write(p, &iov, 1)) {
+      rb_sys_fail("write(2)");
+    }
+    offset += sent;
+#endif
+    if (sent == 0) {
+      rb_raise(rb_eIOError, "file truncated while sending, %ld bytes missing", len);
+    }
+    len -= sent;
+  }
+  return Qnil;
+}
+
 // for test: find or create a request with a fd
 static VALUE ext_request_new(VALUE _) {
   return _request_alloc()->self;
@@ -373,13 +906,21 @@ void Init_request(VALUE nyara, VALUE ext) {
   rb_gc_register_mark_object(str_html);
   sym_reading = ID2SYM(rb_intern("reading"));
   sym_writing = ID2SYM(rb_intern("writing"));
+  sym_cancel = ID2SYM(rb_intern("cancel"));
+  nyara_cancelled_class = rb_define_class_under(nyara, "Cancelled", rb_eException);
   str_transfer_encoding = rb_enc_str_new("Transfer-Encoding", strlen("Transfer-Encoding"), u8_encoding);
   rb_gc_register_mark_object(str_transfer_encoding);
+  str_content_length = rb_enc_str_new("Content-Length", strlen("Content-Length"), u8_encoding);
+  rb_gc_register_mark_object(str_content_length);
+  id_aref = rb_intern("[]");
+  request_pool = rb_ary_new();
+  rb_gc_register_mark_object(request_pool);
 
   // request
   request_class = rb_define_class_under(nyara, "Request", rb_cObject);
   rb_define_method(request_class, "http_method", request_http_method, 0);
   rb_define_method(request_class, "header", request_header, 0);
+  rb_define_method(request_class, "header_value", request_header_value, 1);
   rb_define_method(request_class, "scope", request_scope, 0);
   rb_define_method(request_class, "path", request_path, 0);
   rb_define_method(request_class, "query", request_query, 0);
@@ -392,7 +933,10 @@ void Init_request(VALUE nyara, VALUE ext) {
   rb_define_method(request_class, "flash", request_flash, 0);
   rb_define_method(request_class, "flash=", request_flash_eq, 1);
   rb_define_method(request_class, "body", request_body, 0);
+  rb_define_method(request_class, "read_body_chunk", request_read_body_chunk, 0);
+  rb_define_method(request_class, "read_part", request_read_part, 0);
   rb_define_method(request_class, "message_complete?", request_message_complete_p, 0);
+  rb_define_method(request_class, "keep_alive?", request_keep_alive_p, 0);
 
   rb_define_method(request_class, "status", request_status, 0);
   rb_define_method(request_class, "response_content_type", request_response_content_type, 0);
@@ -404,6 +948,10 @@ void Init_request(VALUE nyara, VALUE ext) {
   rb_define_singleton_method(ext, "request_set_status", ext_request_set_status, 2);
   rb_define_singleton_method(ext, "request_send_data", ext_request_send_data, 2);
   rb_define_singleton_method(ext, "request_send_chunk", ext_request_send_chunk, 2);
+  rb_define_singleton_method(ext, "request_send_file", ext_request_send_file, 4);
+  rb_define_singleton_method(ext, "request_flush", ext_request_flush, 1);
+  rb_define_singleton_method(ext, "request_invoke_action", ext_request_invoke_action, 1);
+  rb_define_singleton_method(ext, "fiber_yield", ext_fiber_yield, 1);
   // for test
   rb_define_singleton_method(ext, "request_new", ext_request_new, 0);
   rb_define_singleton_method(ext, "request_set_fd", ext_request_set_fd, 2);
@@ -4,11 +4,32 @@
 #include <multipart_parser.h>
 #include <errno.h>
 #include <unistd.h>
+#include <sys/uio.h>
 
 enum ParseState {
   PS_INIT, PS_HEADERS_COMPLETE, PS_MESSAGE_COMPLETE, PS_ERROR
 };
 
+// offsets of a header line in the raw header buffer, value is -1 before parsed
+typedef struct {
+  long field;
+  long field_len;
+  long value;
+  long value_len;
+} HeaderSpan;
+
+// phase timestamps of a request in rdtsc ticks, see route_stats.c
+enum {
+  PH_ACCEPT,       // connection accepted, or previous request in it finished
+  PH_FIRST_BYTE,
+  PH_HEADERS,      // request headers complete
+  PH_ROUTE,        // message complete and route matched
+  PH_DISPATCH,     // action fiber started
+  PH_HEADERS_SENT, // first response data written
+  PH_CLOSE,        // response finished
+  PH_COUNT
+};
+
 typedef struct {
   http_parser hparser;
   multipart_parser* mparser;
@@ -19,10 +40,9 @@ typedef struct {
   int status;   // response status
 
   VALUE self;
-  VALUE rid;    // fixnum
 
   // request
-  VALUE header;
+  VALUE header; // nil until accessed, then materialized from the raw header
   VALUE accept; // mime array sorted with q
   VALUE format; // string ext without dot
   VALUE fiber;
@@ -34,6 +54,7 @@ typedef struct {
   VALUE last_value;
   VALUE last_part; // multipart last header or body
   VALUE body; // string when single part, array when multipart
+  VALUE pipelined; // unparsed data of next request in the same connection
 
   // env
   VALUE cookie;
@@ -47,10 +68,56 @@ typedef struct {
 
   VALUE watched_fds;
   VALUE instance;
+  VALUE route_args[MAX_ROUTE_ARGS]; // action id and converted captures
+  int route_args_len;
+  long route_id;   // stats slot of matched route, -1 if not matched
+  unsigned long long phases[PH_COUNT]; // 0 if not reached
+  long sent_bytes; // response bytes written, for access log
 
+  VALUE yielded;   // last state yielded by the action fiber
+  int interest;    // events registered for fd, -1 if it should be re-armed, see event.c
   bool sleeping;
+  bool cancelled;  // client disconnected, action is resumed with :cancel
+  bool streaming;  // action consumes body by chunks or parts, see request_read_body_chunk
+  bool keep_alive; // client accepts persistent connection and limit not reached
+  bool fiber_done; // the action fiber returned from dispatch and can serve another request
+  long served;     // number of requests finished in this connection
   long updated_at; // in timestamp seconds
+  long wake_at;    // in timestamp milliseconds, valid when sleeping
+  long timer_index; // position in event.c timer heap, -1 if not scheduled
+  void* wake_next;  // next in event.c wake list
+  int wake_queued;  // set atomically when pushed to wake list
+  unsigned long gen;      // increases when the request is reset, so a late wakeup doesn't wake the next request
+  unsigned long wake_gen; // generation of a pending wakeup, consumed by sleep, 0 if none
+
+  char* out_buf;   // buffered output
+  long out_len;
+  long out_capa;
+  bool term_pending; // action terminated, but output is not sent yet
+
+  char* hbuf;      // raw header fields and values
+  long hbuf_len;
+  long hbuf_capa;
+  HeaderSpan* hspans;
+  long hspans_len;
+  long hspans_capa;
+
+  VALUE part_data; // decoded data of current part when kept in memory
+  PartDecoder part_decoder; // transfer encoding of current part
+  int part_fd;      // temp file of current part when spilled, -1 if in memory
+  char* part_buf;   // write buffer of part_fd
+  long part_buf_len;
 } Request;
 
 Request* nyara_request_new(int fd);
+void nyara_request_recycle(Request*);
+void nyara_detach_request(Request*); // event.c
+void nyara_fiber_release(Request*); // event.c
 void nyara_request_touch(Request*);
+bool nyara_request_write(Request*, struct iovec* iov, int iovcnt);
+bool nyara_request_flush(Request*);
+bool nyara_request_body_pending(Request*);
+void nyara_request_header_append(Request*, bool is_value, const char* s, long len);
+const char* nyara_request_header_value(Request*, const char* field, long field_len, long* value_len);
+void nyara_route_stats_record(Request*); // route_stats.c
+void nyara_access_log_push(Request*); // access_log.c
@@ -2,11 +2,21 @@
 
 #include "nyara.h"
 #include "request.h"
+#include "inc/rdtsc.h"
 #include <ruby/re.h>
+#include <fcntl.h>
+#include <limits.h>
+
+// parts larger than this are spilled to temp files
+static long part_memory_limit = 1 << 20;
+static char part_tmp_dir[PATH_MAX] = "/tmp";
+#define PART_BUF_SIZE 65536
 
-static ID id_update;
 static ID id_final;
-static VALUE str_accept;
+static ID id_for_fd;
+static VALUE str_data;
+static VALUE str_mechanism;
+static VALUE str_tempfile;
 static VALUE str_content_type;
 static VALUE method_override_key;
 static VALUE nyara_http_methods;
@@ -54,17 +64,149 @@ static int mp_headers_complete(multipart_parser* parser) {
   p->last_field = Qnil;
   p->last_value = Qnil;
   p->last_part = rb_class_new_instance(1, &p->last_part, part_class);
+
+  VALUE mechanism = rb_hash_aref(p->last_part, str_mechanism);
+  if (TYPE(mechanism) == T_STRING) {
+    nyara_part_decoder_init(&p->part_decoder, RSTRING_PTR(mechanism), RSTRING_LEN(mechanism));
+  } else {
+    nyara_part_decoder_init(&p->part_decoder, "", 0);
+  }
+  p->part_data = rb_hash_aref(p->last_part, str_data);
+  p->part_fd = -1;
+  p->part_buf_len = 0;
   return 0;
 }
 
+static bool _write_all(int fd, const char* s, long len) {
+  while (len > 0) {
+    long written = write(fd, s, len);
+    if (written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+    s += written;
+    len -= written;
+  }
+  return true;
+}
+
+// the part can't be stored. we are in parser callbacks on the event loop, so don't raise:
+// mark the request and event.c closes the connection
+static void _part_fail(Request* p) {
+  p->parse_state = PS_ERROR;
+  if (p->part_fd >= 0) {
+    // fd is owned by the File object
+    rb_io_close(rb_hash_aref(p->last_part, str_tempfile));
+    p->part_fd = -1;
+  }
+  p->part_data = Qnil;
+  p->part_buf_len = 0;
+}
+
+static void _part_flush(Request* p) {
+  if (p->part_buf_len) {
+    if (!_write_all(p->part_fd, p->part_buf, p->part_buf_len)) {
+      _part_fail(p);
+      return;
+    }
+    p->part_buf_len = 0;
+  }
+}
+
+static VALUE _part_file_open(VALUE v_fd) {
+  return rb_funcall(rb_cFile, id_for_fd, 2, v_fd, rb_str_new2("r+b"));
+}
+
+// move part data to an unlinked temp file, which is exposed as part['tempfile']
+static void _part_spill(Request* p) {
+  char path[PATH_MAX];
+  snprintf(path, PATH_MAX, "%s/nyara-part-XXXXXX", part_tmp_dir);
+  int fd = mkstemp(path);
+  if (fd < 0) {
+    _part_fail(p);
+    return;
+  }
+  unlink(path);
+  fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+  // the File object owns fd, and is kept alive by the part
+  int state = 0;
+  volatile VALUE io = rb_protect(_part_file_open, INT2FIX(fd), &state);
+  if (state) {
+    rb_set_errinfo(Qnil);
+    close(fd);
+    _part_fail(p);
+    return;
+  }
+  rb_hash_aset(p->last_part, str_tempfile, io);
+  rb_hash_delete(p->last_part, str_data);
+
+  if (!p->part_buf) {
+    p->part_buf = ALLOC_N(char, PART_BUF_SIZE);
+  }
+  p->part_fd = fd;
+  p->part_buf_len = 0;
+  if (!_write_all(fd, RSTRING_PTR(p->part_data), RSTRING_LEN(p->part_data))) {
+    _part_fail(p);
+    return;
+  }
+  p->part_data = Qnil;
+}
+
+static void _part_write(Request* p, const char* s, long len) {
+  if (p->parse_state == PS_ERROR) {
+    return;
+  }
+  if (p->part_fd < 0) {
+    if (RSTRING_LEN(p->part_data) + len <= part_memory_limit) {
+      rb_str_cat(p->part_data, s, len);
+      return;
+    }
+    _part_spill(p);
+    if (p->parse_state == PS_ERROR) {
+      return;
+    }
+  }
+
+  if (p->part_buf_len + len > PART_BUF_SIZE) {
+    _part_flush(p);
+    if (p->parse_state == PS_ERROR) {
+      return;
+    }
+  }
+  if (len >= PART_BUF_SIZE) {
+    if (!_write_all(p->part_fd, s, len)) {
+      _part_fail(p);
+    }
+  } else {
+    memcpy(p->part_buf + p->part_buf_len, s, len);
+    p->part_buf_len += len;
+  }
+}
+
+static void _part_sink(void* data, const char* s, long len) {
+  _part_write((Request*)data, s, len);
+}
+
 static int mp_part_data(multipart_parser* parser, const char* s, size_t len) {
   Request* p = multipart_parser_get_data(parser);
-  rb_funcall(p->last_part, id_update, 1, rb_str_new(s, len)); // no need encoding
-  return 0;
+  nyara_part_decode(&p->part_decoder, s, len, _part_sink, p);
+  return p->parse_state == PS_ERROR;
 }
 
 static int mp_part_data_end(multipart_parser* parser) {
   Request* p = multipart_parser_get_data(parser);
+  nyara_part_decode_final(&p->part_decoder, _part_sink, p);
+  if (p->part_fd >= 0) {
+    _part_flush(p);
+  }
+  if (p->parse_state == PS_ERROR) {
+    return 1;
+  }
+  p->part_fd = -1;
+  p->part_data = Qnil;
   rb_ary_push(p->body, rb_funcall(p->last_part, id_final, 0));
   p->last_part = Qnil;
   return 0;
@@ -94,31 +236,20 @@ static int on_url(http_parser* parser, const char* s, size_t len) {
   return 0;
 }
 
+// header lines are only recorded in the raw buffer, ruby strings are created when accessed
 static int on_header_field(http_parser* parser, const char* s, size_t len) {
   Request* p = (Request*)parser;
-  if (p->last_field == Qnil) {
-    p->last_field = rb_enc_str_new(s, len, u8_encoding);
-    p->last_value = Qnil;
-  } else {
-    rb_str_cat(p->last_field, s, len);
-  }
+  nyara_request_header_append(p, false, s, len);
   return 0;
 }
 
 static int on_header_value(http_parser* parser, const char* s, size_t len) {
   Request* p = (Request*)parser;
-  if (p->last_field == Qnil) {
-    if (p->last_value == Qnil) {
-      p->parse_state = PS_ERROR;
-      return 1;
-    }
-    rb_str_cat(p->last_value, s, len);
-  } else {
-    nyara_headerlize(p->last_field);
-    p->last_value = rb_enc_str_new(s, len, u8_encoding);
-    rb_hash_aset(p->header, p->last_field, p->last_value);
-    p->last_field = Qnil;
+  if (!p->hspans_len) {
+    p->parse_state = PS_ERROR;
+    return 1;
   }
+  nyara_request_header_append(p, true, s, len);
   return 0;
 }
 
@@ -138,6 +269,9 @@ static void _parse_path_and_query(Request* p) {
   long len = RSTRING_LEN(p->path_with_query);
   long query_i = nyara_parse_path(p->path, s, len);
   if (query_i < len) {
+    if (p->query == Qnil) {
+      p->query = rb_class_new_instance(0, NULL, nyara_param_hash_class);
+    }
     nyara_parse_query(p->query, s + query_i, len - query_i);
 
     // do method override with _method=xxx in query
@@ -154,7 +288,7 @@ static void _parse_path_and_query(Request* p) {
   }
 }
 
-static char* _parse_multipart_boundary(VALUE header) {
+static char* _parse_multipart_boundary(const char* s, long len) {
   static regex_t* re = NULL;
   static OnigRegion region;
   if (!re) {
@@ -166,14 +300,10 @@ static char* _parse_multipart_boundary(VALUE header) {
     onig_region_init(&region);
   }
 
-  VALUE content_type = rb_hash_aref(header, str_content_type);
-  if (content_type == Qnil) {
+  if (!s) {
     return NULL;
   }
 
-  long len = RSTRING_LEN(content_type);
-  char* s = RSTRING_PTR(content_type);
-
   long matched_len = onig_match(re, (const UChar*)s, (const UChar*)(s + len), (const UChar*)s, &region, 0);
   if (matched_len > 0) {
     // multipart-parser needs a buffer to end with '\0', and "--" before boundary
@@ -191,14 +321,19 @@ static char* _parse_multipart_boundary(VALUE header) {
 
 static int on_headers_complete(http_parser* parser) {
   Request* p = (Request*)parser;
+  p->phases[PH_HEADERS] = rdtsc();
   p->last_field = Qnil;
   p->last_value = Qnil;
 
   _parse_path_and_query(p);
-  p->accept = ext_parse_accept_value(Qnil, rb_hash_aref(p->header, str_accept));
+  long len;
+  const char* s = nyara_request_header_value(p, "Accept", 6, &len);
+  p->accept = ext_parse_accept_value(Qnil, s ? rb_str_new(s, len) : Qnil);
   p->parse_state = PS_HEADERS_COMPLETE;
+  p->keep_alive = p->method != HTTP_HEAD && http_should_keep_alive(parser) && nyara_keep_alive_p(p->served);
 
-  char* boundary = _parse_multipart_boundary(p->header);
+  s = nyara_request_header_value(p, "Content-Type", 12, &len);
+  char* boundary = _parse_multipart_boundary(s, len);
   if (boundary) {
     p->mparser = multipart_parser_init(boundary, &multipart_settings);
     xfree(boundary);
@@ -216,9 +351,10 @@ static int on_body(http_parser* parser, const char* s, size_t len) {
   if (p->mparser) {
     size_t parsed = multipart_parser_execute(p->mparser, s, len);
     if (parsed != len) {
-      rb_raise(rb_eRuntimeError, "multipart chunk parse failure at %lu", parsed);
+      // malformed, or the part can't be stored
+      p->parse_state = PS_ERROR;
+      return 1;
     }
-    // todo sum total length, if too big, trigger save to tmpfile
   } else {
     rb_str_cat(p->body, s, len);
   }
@@ -228,6 +364,8 @@ static int on_body(http_parser* parser, const char* s, size_t len) {
 static int on_message_complete(http_parser* parser) {
   Request* p = (Request*)parser;
   p->parse_state = PS_MESSAGE_COMPLETE;
+  // stop here, the rest data belongs to the next pipelined request
+  http_parser_pause(parser, 1);
   return 0;
 }
 
@@ -244,7 +382,11 @@ http_parser_settings nyara_request_parse_settings = {
 };
 
 static VALUE ext_parse_multipart_boundary(VALUE _, VALUE header) {
-  char* s = _parse_multipart_boundary(header);
+  VALUE content_type = rb_hash_aref(header, str_content_type);
+  if (content_type == Qnil) {
+    return Qnil;
+  }
+  char* s = _parse_multipart_boundary(RSTRING_PTR(content_type), RSTRING_LEN(content_type));
   if (s) {
     volatile VALUE res = rb_str_new2(s);
     xfree(s);
@@ -254,11 +396,27 @@ static VALUE ext_parse_multipart_boundary(VALUE _, VALUE header) {
   }
 }
 
+// keep at most [limit] bytes of a multipart part in memory, larger parts are written to temp files in [dir]
+static VALUE ext_set_part_memory_limit(VALUE _, VALUE v_limit, VALUE v_dir) {
+  Check_Type(v_dir, T_STRING);
+  if (RSTRING_LEN(v_dir) + 20 >= PATH_MAX) {
+    rb_raise(rb_eArgError, "temp dir path too long");
+  }
+  part_memory_limit = NUM2LONG(v_limit);
+  memcpy(part_tmp_dir, RSTRING_PTR(v_dir), RSTRING_LEN(v_dir));
+  part_tmp_dir[RSTRING_LEN(v_dir)] = '\0';
+  return Qnil;
+}
+
 void Init_request_parse(VALUE nyara, VALUE ext) {
-  id_update = rb_intern("update");
   id_final = rb_intern("final");
-  str_accept = rb_enc_str_new("Accept", strlen("Accept"), u8_encoding);
-  rb_gc_register_mark_object(str_accept);
+  id_for_fd = rb_intern("for_fd");
+  str_data = rb_enc_str_new("data", strlen("data"), u8_encoding);
+  rb_gc_register_mark_object(str_data);
+  str_mechanism = rb_enc_str_new("mechanism", strlen("mechanism"), u8_encoding);
+  rb_gc_register_mark_object(str_mechanism);
+  str_tempfile = rb_enc_str_new("tempfile", strlen("tempfile"), u8_encoding);
+  rb_gc_register_mark_object(str_tempfile);
   str_content_type = rb_enc_str_new("Content-Type", strlen("Content-Type"), u8_encoding);
   rb_gc_register_mark_object(str_content_type);
   method_override_key = rb_enc_str_new("_method", strlen("_method"), u8_encoding);
@@ -266,6 +424,8 @@ void Init_request_parse(VALUE nyara, VALUE ext) {
   rb_const_set(nyara, rb_intern("METHOD_OVERRIDE_KEY"), method_override_key);
   nyara_http_methods = rb_const_get(nyara, rb_intern("HTTP_METHODS"));
 
+  rb_define_singleton_method(ext, "set_part_memory_limit", ext_set_part_memory_limit, 2);
+
   // for test
   rb_define_singleton_method(ext, "parse_multipart_boundary", ext_parse_multipart_boundary, 1);
 }
@@ -6,14 +6,37 @@ extern "C" {
 #include <ruby/re.h>
 #include <vector>
 #include <map>
+#include <string>
+#include <algorithm>
+#include <climits>
 #include "inc/str_intern.h"
 #ifndef isalnum
 #include <cctype>
 #endif
 
+// typed segment of suffix, so common suffixes can be matched without onig
+enum SegType {
+  SEG_LIT,   // literal bytes
+  SEG_INT,   // (-?\d+)
+  SEG_UINT,  // (\d+)
+  SEG_HEX,   // (\h+)
+  SEG_FLOAT, // see FLOAT_RE
+  SEG_STR,   // ([^/]+)
+  SEG_ANY,   // (.*)
+  SEG_EOL    // $
+};
+
+struct Seg {
+  SegType type;
+  std::string lit;
+};
+
+// same as the %f regexp generated by Route#compile_re
+static const char FLOAT_RE[] = "([-+]?(?:0[xX](?:\\.\\h+|\\h+(?:\\.\\h*)?)[pP][-+]\\d+|\\d+(?![\\d.])|\\d*\\.\\d*(?:[eE][-+]?\\d+)?))";
+
 struct RouteEntry {
-  // note on order: scope is supposed to be the last, but when searching, is_sub is checked first
-  bool is_sub; // = last_prefix.start_with? prefix
+  // note on order: scope is supposed to be the last
+  bool is_sub; // = last_prefix.start_with? prefix, only for inspect
   char* prefix;
   long prefix_len;
   regex_t *suffix_re;
@@ -25,6 +48,9 @@ struct RouteEntry {
   VALUE scope;
   char* suffix; // only for inspect
   long suffix_len;
+  bool typed; // suffix is compiled into segs, suffix_re is used only when segs can not decide
+  std::vector<Seg> segs;
+  long stats_id; // slot in route_stats.c
 
   // don't make it destructor, or it could be called twice if on stack
   void dealloc() {
@@ -45,12 +71,35 @@ struct RouteEntry {
 
 typedef std::vector<RouteEntry> RouteEntries;
 typedef RouteEntries::iterator EntriesIter;
-typedef std::map<enum http_method, RouteEntries*> RouteMap;
+
+// radix tree over prefixes, a node holds indexes of entries whose prefix ends at it
+struct RadixNode {
+  std::string label;
+  std::vector<RadixNode*> children; // distinct first bytes of label
+  std::vector<long> entries;
+
+  ~RadixNode() {
+    for (size_t i = 0; i < children.size(); i++) {
+      delete children[i];
+    }
+  }
+};
+
+struct RouteTable {
+  RouteEntries entries; // in registered order, which is the precedence
+  RadixNode root;
+};
+
+typedef std::map<enum http_method, RouteTable*> RouteMap;
 typedef RouteMap::iterator MapIter;
 
 static RouteMap route_map;
 static OnigRegion region; // we can reuse the region without worrying thread safety
+static std::vector<long> candidates; // reused in lookup
 static ID id_to_s;
+static ID id_to_i;
+static ID id_to_f;
+static ID id_hex;
 static VALUE str_html;
 static VALUE nyara_http_methods;
 
@@ -77,29 +126,312 @@ static enum http_method canonicalize_http_method(VALUE m) {
   return (enum http_method)FIX2INT(method_num);
 }
 
+static void radix_insert(RadixNode* node, const char* s, long len, long index) {
+  while (len) {
+    RadixNode* child = NULL;
+    for (size_t i = 0; i < node->children.size(); i++) {
+      if (node->children[i]->label[0] == s[0]) {
+        child = node->children[i];
+        break;
+      }
+    }
+    if (!child) {
+      child = new RadixNode();
+      child->label.assign(s, len);
+      child->entries.push_back(index);
+      node->children.push_back(child);
+      return;
+    }
+
+    long label_len = child->label.size();
+    long common = 0;
+    while (common < label_len && common < len && child->label[common] == s[common]) {
+      common++;
+    }
+    if (common < label_len) {
+      // split child at common
+      RadixNode* tail = new RadixNode();
+      tail->label = child->label.substr(common);
+      tail->children.swap(child->children);
+      tail->entries.swap(child->entries);
+      child->label.resize(common);
+      child->children.push_back(tail);
+    }
+    node = child;
+    s += common;
+    len -= common;
+  }
+  node->entries.push_back(index);
+}
+
+// collect indexes of entries whose prefix is a prefix of path, in registered order
+static void radix_collect(RadixNode* node, const char* s, long len, std::vector<long>& out) {
+  out.clear();
+  out.insert(out.end(), node->entries.begin(), node->entries.end());
+  while (len) {
+    RadixNode* child = NULL;
+    for (size_t i = 0; i < node->children.size(); i++) {
+      if (node->children[i]->label[0] == s[0]) {
+        child = node->children[i];
+        break;
+      }
+    }
+    if (!child || !start_with(s, len, child->label.data(), child->label.size())) {
+      break;
+    }
+    node = child;
+    s += child->label.size();
+    len -= child->label.size();
+    out.insert(out.end(), node->entries.begin(), node->entries.end());
+  }
+  std::sort(out.begin(), out.end());
+}
+
+// compile regexp generated by Route#compile_re into typed segments,
+// return false if it contains something else
+static bool compile_segs(const char* s, long len, std::vector<Seg>& segs) {
+  static const struct { const char* re; SegType type; } captures[] = {
+    {"(-?\\d+)", SEG_INT},
+    {"(\\d+)", SEG_UINT},
+    {"(\\h+)", SEG_HEX},
+    {"([^/]+)", SEG_STR},
+    {"(.*)", SEG_ANY},
+    {FLOAT_RE, SEG_FLOAT}
+  };
+
+  segs.clear();
+  long i = 0;
+  if (len && s[0] == '^') {
+    i++;
+  }
+  while (i < len) {
+    char c = s[i];
+    if (c == '(') {
+      bool found = false;
+      for (size_t j = 0; j < sizeof(captures) / sizeof(captures[0]); j++) {
+        long re_len = strlen(captures[j].re);
+        if (start_with(s + i, len - i, captures[j].re, re_len)) {
+          Seg seg = {captures[j].type, ""};
+          segs.push_back(seg);
+          i += re_len;
+          found = true;
+          break;
+        }
+      }
+      if (!found) {
+        return false;
+      }
+      continue;
+    }
+
+    if (c == '$' && i == len - 1) {
+      Seg seg = {SEG_EOL, ""};
+      segs.push_back(seg);
+      break;
+    }
+
+    // literal char
+    if (c == '\\') {
+      if (i + 1 == len) {
+        return false;
+      }
+      c = s[++i];
+      switch (c) {
+        case 'n': c = '\n'; break;
+        case 't': c = '\t'; break;
+        case 'r': c = '\r'; break;
+        case 'f': c = '\f'; break;
+        case 'v': c = '\v'; break;
+        default:
+          if (isalnum((unsigned char)c)) {
+            return false; // \d, \h ...
+          }
+      }
+    } else if (strchr(".*+?()[]{}|^$", c)) {
+      return false;
+    }
+    if (segs.empty() || segs.back().type != SEG_LIT) {
+      Seg seg = {SEG_LIT, ""};
+      segs.push_back(seg);
+    }
+    segs.back().lit.push_back(c);
+    i++;
+  }
+  return true;
+}
+
+#define SEG_BAIL -2
+
+static bool is_digit(char c) {
+  return c >= '0' && c <= '9';
+}
+
+static bool is_hex(char c) {
+  return is_digit(c) || (c >= 'a' && c <= 'f') || (c >= 'A' && c <= 'F');
+}
+
+static long run_of(const char* s, long len, long pos, bool (*pred)(char)) {
+  long n = 0;
+  while (pos + n < len && pred(s[pos + n])) {
+    n++;
+  }
+  return n;
+}
+
+static bool not_slash(char c) {
+  return c != '/';
+}
+
+static bool not_newline(char c) {
+  return c != '\n';
+}
+
+// candidate end positions of segment at pos, in the same order onig would try them
+static void seg_ends(const Seg& seg, const char* s, long len, long pos, std::vector<long>& ends) {
+  long n;
+  switch (seg.type) {
+    case SEG_INT:
+      if (pos < len && s[pos] == '-') {
+        pos++;
+      }
+      // fall through
+    case SEG_UINT:
+      n = run_of(s, len, pos, is_digit);
+      for (; n >= 1; n--) {
+        ends.push_back(pos + n);
+      }
+      break;
+    case SEG_HEX:
+      n = run_of(s, len, pos, is_hex);
+      for (; n >= 1; n--) {
+        ends.push_back(pos + n);
+      }
+      break;
+    case SEG_STR:
+      n = run_of(s, len, pos, not_slash);
+      for (; n >= 1; n--) {
+        ends.push_back(pos + n);
+      }
+      break;
+    case SEG_ANY:
+      n = run_of(s, len, pos, not_newline);
+      for (; n >= 0; n--) {
+        ends.push_back(pos + n);
+      }
+      break;
+    case SEG_FLOAT: {
+      if (pos < len && (s[pos] == '-' || s[pos] == '+')) {
+        pos++;
+      }
+      n = run_of(s, len, pos, is_digit);
+      long dot = pos + n;
+      if (dot < len && s[dot] == '.') {
+        // \d*\.\d*(?:[eE][-+]?\d+)?
+        long m = run_of(s, len, dot + 1, is_digit);
+        for (; m >= 0; m--) {
+          long e = dot + 1 + m;
+          if (e < len && (s[e] == 'e' || s[e] == 'E')) {
+            long ep = e + 1;
+            if (ep < len && (s[ep] == '-' || s[ep] == '+')) {
+              ep++;
+            }
+            long r = run_of(s, len, ep, is_digit);
+            for (; r >= 1; r--) {
+              ends.push_back(ep + r);
+            }
+          }
+          ends.push_back(e);
+        }
+      } else if (n) {
+        // \d+(?![\d.])
+        ends.push_back(dot);
+      }
+      break;
+    }
+    default:
+      break;
+  }
+}
+
+// backtracking match of segs from [i], captures are written into region.
+// returns matched length, -1 if not matched, or SEG_BAIL when onig should decide
+static long match_segs(const std::vector<Seg>& segs, size_t i, int cap, const char* s, long len, long pos) {
+  if (i == segs.size()) {
+    return pos;
+  }
+  const Seg& seg = segs[i];
+  if (seg.type == SEG_LIT) {
+    if (!start_with(s + pos, len - pos, seg.lit.data(), seg.lit.size())) {
+      return -1;
+    }
+    return match_segs(segs, i + 1, cap, s, len, pos + seg.lit.size());
+  }
+  if (seg.type == SEG_EOL) {
+    return (pos == len || s[pos] == '\n') ? pos : -1;
+  }
+  if (seg.type == SEG_FLOAT) {
+    long p = pos;
+    if (p < len && (s[p] == '-' || s[p] == '+')) {
+      p++;
+    }
+    if (p + 1 < len && s[p] == '0' && (s[p + 1] == 'x' || s[p + 1] == 'X')) {
+      return SEG_BAIL; // hex float
+    }
+  }
+
+  std::vector<long> ends;
+  seg_ends(seg, s, len, pos, ends);
+  for (size_t j = 0; j < ends.size(); j++) {
+    long r = match_segs(segs, i + 1, cap + 1, s, len, ends[j]);
+    if (r != -1) {
+      if (r >= 0) {
+        region.beg[cap] = pos;
+        region.end[cap] = ends[j];
+      }
+      return r;
+    }
+  }
+  return -1;
+}
+
+// match suffix with typed segs if possible, same result as onig_match
+static long match_suffix(RouteEntry* e, const char* suffix, long suffix_len) {
+  if (e->typed) {
+    onig_region_resize(&region, e->conv.size() + 1);
+    long r = match_segs(e->segs, 0, 1, suffix, suffix_len, 0);
+    if (r != SEG_BAIL) {
+      return r;
+    }
+  }
+  return onig_match(e->suffix_re, (const UChar*)suffix, (const UChar*)(suffix + suffix_len),
+                    (const UChar*)suffix, &region, 0);
+}
+
 static VALUE ext_clear_route(VALUE req) {
   for (MapIter i = route_map.begin(); i != route_map.end(); ++i) {
-    RouteEntries* entries = i->second;
+    RouteEntries* entries = &(i->second->entries);
     for (EntriesIter j = entries->begin(); j != entries->end(); ++j) {
       j->dealloc();
     }
-    delete entries;
+    delete i->second;
   }
   route_map.clear();
+  nyara_route_stats_clear();
   return Qnil;
 }
 
 static VALUE ext_register_route(VALUE self, VALUE v_e) {
   // get route entries
   enum http_method m = canonicalize_http_method(rb_iv_get(v_e, "@http_method"));
-  RouteEntries* route_entries;
+  RouteTable* table;
   MapIter map_iter = route_map.find(m);
   if (map_iter == route_map.end()) {
-    route_entries = new RouteEntries();
-    route_map[m] = route_entries;
+    table = new RouteTable();
+    route_map[m] = table;
   } else {
-    route_entries = map_iter->second;
+    table = map_iter->second;
   }
+  RouteEntries* route_entries = &(table->entries);
 
   // prefix
   VALUE v_prefix = rb_iv_get(v_e, "@prefix");
@@ -144,16 +476,31 @@ static VALUE ext_register_route(VALUE self, VALUE v_e) {
     e.dealloc();
     rb_raise(rb_eRuntimeError, "number of captures mismatch");
   }
+  if (conv_len >= MAX_ROUTE_ARGS) {
+    e.dealloc();
+    rb_raise(rb_eRuntimeError, "too many captures, should be less than %d", MAX_ROUTE_ARGS);
+  }
   for (long i = 0; i < conv_len; i++) {
     ID conv_id = SYM2ID(conv_ptr[i]);
     e.conv.push_back(conv_id);
   }
+  e.typed = compile_segs(suffix, suffix_len, e.segs);
 
   // accept
   e.accept_exts = rb_iv_get(v_e, "@accept_exts");
   e.accept_mimes = rb_iv_get(v_e, "@accept_mimes");
 
+  // [method, prefix, suffix, controller, id] to label the stats
+  volatile VALUE label = rb_ary_new();
+  rb_ary_push(label, rb_enc_str_new(http_method_str(m), strlen(http_method_str(m)), u8_encoding));
+  rb_ary_push(label, v_prefix);
+  rb_ary_push(label, v_suffix);
+  rb_ary_push(label, e.controller);
+  rb_ary_push(label, e.id);
+  e.stats_id = nyara_route_stats_add(label);
+
   route_entries->push_back(e);
+  radix_insert(&(table->root), prefix, prefix_len, route_entries->size() - 1);
   return Qnil;
 }
 
@@ -165,7 +512,7 @@ static VALUE ext_list_route(VALUE self) {
 
   volatile VALUE route_hash = rb_hash_new();
   for (MapIter j = route_map.begin(); j != route_map.end(); j++) {
-    RouteEntries* route_entries = j->second;
+    RouteEntries* route_entries = &(j->second->entries);
     arr = rb_ary_new();
     rb_hash_aset(route_hash, rb_enc_str_new(http_method_str(j->first), strlen(http_method_str(j->first)), u8_encoding), arr);
     for (EntriesIter i = route_entries->begin(); i != route_entries->end(); i++) {
@@ -187,27 +534,66 @@ static VALUE ext_list_route(VALUE self) {
   return route_hash;
 }
 
-static VALUE build_args(const char* suffix, std::vector<ID>& conv, volatile VALUE args) {
-  volatile VALUE str = rb_str_new2(""); // tmp for conversion, no need encoding
-  long last_len = 0;
+// parse integer of [base] from path bytes, no allocation unless it overflows long
+static VALUE parse_int(const char* s, long len, int base) {
+  bool neg = false;
+  long i = 0;
+  if (s[0] == '-') {
+    neg = true;
+    i++;
+  }
+  long limit = LONG_MAX / base;
+  long n = 0;
+  for (; i < len; i++) {
+    int d;
+    char c = s[i];
+    if (c >= '0' && c <= '9') {
+      d = c - '0';
+    } else if (c >= 'a' && c <= 'f') {
+      d = c - 'a' + 10;
+    } else {
+      d = c - 'A' + 10;
+    }
+    if (n > limit || n * base > LONG_MAX - d) {
+      return rb_str_to_inum(rb_str_new(s, len), base, 0);
+    }
+    n = n * base + d;
+  }
+  return LONG2NUM(neg ? -n : n);
+}
+
+// same as String#to_f
+static VALUE parse_float(const char* s, long len) {
+  char buf[64];
+  if (len >= (long)sizeof(buf)) {
+    return DBL2NUM(rb_str_to_dbl(rb_str_new(s, len), 0));
+  }
+  memcpy(buf, s, len);
+  buf[len] = '\0';
+  return DBL2NUM(rb_cstr_to_dbl(buf, 0));
+}
+
+// convert captures and append them to r->args
+static void build_args(const char* suffix, std::vector<ID>& conv, RouteResult* r) {
   for (size_t j = 0; j < conv.size(); j++) {
     const char* capture_ptr = suffix + region.beg[j+1];
     long capture_len = region.end[j+1] - region.beg[j+1];
+    VALUE v;
     if (conv[j] == id_to_s) {
-      rb_ary_push(args, rb_enc_str_new(capture_ptr, capture_len, u8_encoding));
+      v = rb_enc_str_new(capture_ptr, capture_len, u8_encoding);
     } else if (capture_len == 0) {
-      rb_ary_push(args, Qnil);
+      v = Qnil;
+    } else if (conv[j] == id_to_i) {
+      v = parse_int(capture_ptr, capture_len, 10);
+    } else if (conv[j] == id_hex) {
+      v = parse_int(capture_ptr, capture_len, 16);
+    } else if (conv[j] == id_to_f) {
+      v = parse_float(capture_ptr, capture_len);
     } else {
-      if (capture_len > last_len) {
-        RESIZE_CAPA(str, capture_len);
-        last_len = capture_len;
-      }
-      memcpy(RSTRING_PTR(str), capture_ptr, capture_len);
-      STR_SET_LEN(str, capture_len);
-      rb_ary_push(args, rb_funcall(str, conv[j], 0)); // hex, to_i, to_f
+      v = rb_funcall(rb_str_new(capture_ptr, capture_len), conv[j], 0);
     }
+    r->args[r->args_len++] = v;
   }
-  return args;
 }
 
 static VALUE extract_ext(const char* s, long len) {
@@ -226,61 +612,58 @@ static VALUE extract_ext(const char* s, long len) {
 
 extern "C"
 RouteResult nyara_lookup_route(enum http_method method_num, VALUE vpath, VALUE accept_arr) {
-  RouteResult r = {Qnil, Qnil, Qnil, Qnil};
+  RouteResult r;
+  r.controller = Qnil;
+  r.args_len = 0;
+  r.scope = Qnil;
+  r.format = Qnil;
+  r.route_id = -1;
   MapIter map_iter = route_map.find(method_num);
   if (map_iter == route_map.end()) {
     return r;
   }
-  RouteEntries* route_entries = map_iter->second;
+  RouteTable* table = map_iter->second;
 
   const char* path = RSTRING_PTR(vpath);
   long len = RSTRING_LEN(vpath);
-  // must iterate all
-  bool last_matched = false;
-  EntriesIter i = route_entries->begin();
-  for (; i != route_entries->end(); ++i) {
-    bool matched;
-    if (i->is_sub && last_matched) { // save a bit compare
-      matched = last_matched;
+  // entries with matched prefix, the first one with matched suffix wins
+  radix_collect(&(table->root), path, len, candidates);
+  RouteEntry* i = NULL;
+  for (size_t c = 0; c < candidates.size(); c++) {
+    i = &(table->entries[candidates[c]]);
+    const char* suffix = path + i->prefix_len;
+    long suffix_len = len - i->prefix_len;
+    if (i->suffix_len == 0) {
+      if (suffix_len) {
+        r.format = extract_ext(suffix, suffix_len);
+        if (r.format == Qnil) {
+          // suffix not match
+          continue;
+        }
+      }
+      r.args[r.args_len++] = i->id;
+      r.controller = i->controller;
+      break;
     } else {
-      matched = start_with(path, len, i->prefix, i->prefix_len);
-    }
-    last_matched = matched;
-
-    if (/* prefix */ matched) {
-      const char* suffix = path + i->prefix_len;
-      long suffix_len = len - i->prefix_len;
-      if (i->suffix_len == 0) {
-        if (suffix_len) {
-          r.format = extract_ext(suffix, suffix_len);
+      long matched_len = match_suffix(i, suffix, suffix_len);
+      if (matched_len > 0) {
+        if (matched_len < suffix_len) {
+          r.format = extract_ext(suffix + matched_len, suffix_len - matched_len);
           if (r.format == Qnil) {
-            // suffix not match
-            continue;
+            break;
           }
         }
-        r.args = rb_ary_new3(1, i->id);
+        r.args[r.args_len++] = i->id;
+        build_args(suffix, i->conv, &r);
         r.controller = i->controller;
         break;
-      } else {
-        long matched_len = onig_match(i->suffix_re, (const UChar*)suffix, (const UChar*)(suffix + suffix_len),
-                                      (const UChar*)suffix, &region, 0);
-        if (matched_len > 0) {
-          if (matched_len < suffix_len) {
-            r.format = extract_ext(suffix + matched_len, suffix_len);
-            if (r.format == Qnil) {
-              break;
-            }
-          }
-          r.args = build_args(suffix, i->conv, rb_ary_new3(1, i->id));
-          r.controller = i->controller;
-          break;
-        }
       }
     }
   }
 
   if (r.controller != Qnil) {
     r.scope = i->scope;
+    r.route_id = i->stats_id;
 
     if (r.format == Qnil) {
       if (i->accept_exts == Qnil) {
@@ -308,7 +691,7 @@ static VALUE ext_lookup_route(VALUE self, VALUE method, VALUE path, VALUE accept
   volatile VALUE a = rb_ary_new();
   rb_ary_push(a, r.scope);
   rb_ary_push(a, r.controller);
-  rb_ary_push(a, r.args);
+  rb_ary_push(a, r.args_len ? rb_ary_new4(r.args_len, (VALUE*)r.args) : Qnil);
   rb_ary_push(a, r.format);
   return a;
 }
@@ -317,6 +700,9 @@ extern "C"
 void Init_route(VALUE nyara, VALUE ext) {
   nyara_http_methods = rb_const_get(nyara, rb_intern("HTTP_METHODS"));
   id_to_s = rb_intern("to_s");
+  id_to_i = rb_intern("to_i");
+  id_to_f = rb_intern("to_f");
+  id_hex = rb_intern("hex");
   str_html = rb_enc_str_new("html", strlen("html"), u8_encoding);
   OBJ_FREEZE(str_html);
   rb_gc_register_mark_object(str_html);
@@ -0,0 +1,236 @@
+/* per-route latency histograms, aggregated from phase timestamps of requests
+ *
+ * a route gets a stats slot when registered, requests record into the slot of the matched route when finished.
+ * time is kept in rdtsc ticks and converted to seconds only when read.
+ */
+
+#include "nyara.h"
+#include "request.h"
+#include "inc/rdtsc.h"
+#include <sys/time.h>
+
+// HDR-style log-linear buckets: values below 2^SUB_BITS ticks are exact,
+// above that every power of 2 is split into 2^SUB_BITS buckets, so the relative error is within 1/2^SUB_BITS
+#define SUB_BITS 4
+#define SUB_COUNT (1 << SUB_BITS)
+// values are clamped to 2^MAX_BITS ticks (a few minutes)
+#define MAX_BITS 40
+#define BUCKET_COUNT ((MAX_BITS - SUB_BITS + 1) * SUB_COUNT)
+
+typedef struct {
+  unsigned long long count;
+  unsigned long long sum;
+  unsigned long long max;
+  unsigned long long phase_sums[PH_COUNT]; // ticks ended at the phase, summed
+  unsigned long long buckets[BUCKET_COUNT]; // first byte to response finished
+} RouteStats;
+
+static RouteStats** stats = NULL;
+static long stats_len = 0;
+static long stats_capa = 0;
+static VALUE stats_labels; // [[method, prefix, suffix, controller, id]] by slot
+
+// tick and time of init, for tick frequency
+static unsigned long long init_ticks;
+static double init_time;
+
+static const char* phase_names[PH_COUNT] = {
+  NULL, "wait", "read_header", "read_body", "setup", "action", "send"
+};
+
+static ID id_method;
+static ID id_prefix;
+static ID id_suffix;
+static ID id_controller;
+static ID id_id;
+static ID id_count;
+static ID id_sum;
+static ID id_max;
+static ID id_p50;
+static ID id_p90;
+static ID id_p99;
+static ID id_p999;
+static ID id_phases;
+static ID id_buckets;
+
+static int _bucket_index(unsigned long long v) {
+  if (v >= (1ULL << MAX_BITS)) {
+    v = (1ULL << MAX_BITS) - 1;
+  }
+  if (v < SUB_COUNT) {
+    return (int)v;
+  }
+  int exp = 63 - __builtin_clzll(v);
+  return (exp - SUB_BITS + 1) * SUB_COUNT + (int)((v >> (exp - SUB_BITS)) & (SUB_COUNT - 1));
+}
+
+// exclusive upper bound of bucket in ticks
+static unsigned long long _bucket_upper(int i) {
+  if (i < SUB_COUNT) {
+    return i + 1;
+  }
+  int exp = i / SUB_COUNT + SUB_BITS - 1;
+  unsigned long long unit = 1ULL << (exp - SUB_BITS);
+  return (SUB_COUNT + i % SUB_COUNT + 1) * unit;
+}
+
+static double _wall_time() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+// measured against wall time since init, the first call may wait a few milliseconds for precision.
+// it is also called from the access log writer thread, so it must not touch ruby
+double nyara_ticks_per_sec() {
+  double elapsed;
+  while ((elapsed = _wall_time() - init_time) < 0.01) {
+  }
+  return (rdtsc() - init_ticks) / elapsed;
+}
+
+long nyara_route_stats_add(VALUE label) {
+  if (stats_len == stats_capa) {
+    stats_capa = stats_capa ? stats_capa * 2 : 64;
+    REALLOC_N(stats, RouteStats*, stats_capa);
+  }
+  RouteStats* s = ALLOC(RouteStats);
+  MEMZERO(s, RouteStats, 1);
+  stats[stats_len] = s;
+  OBJ_FREEZE(label);
+  rb_ary_push(stats_labels, label);
+  return stats_len++;
+}
+
+void nyara_route_stats_clear() {
+  for (long i = 0; i < stats_len; i++) {
+    xfree(stats[i]);
+  }
+  stats_len = 0;
+  rb_ary_clear(stats_labels);
+}
+
+// called when the response is finished, requests not routed or cancelled are not counted.
+// NOTE route_id may be stale if routes are cleared while the request is running
+void nyara_route_stats_record(Request* p) {
+  if (p->route_id < 0 || p->route_id >= stats_len || !p->phases[PH_FIRST_BYTE]) {
+    return;
+  }
+  RouteStats* s = stats[p->route_id];
+  unsigned long long prev = p->phases[PH_ACCEPT];
+  for (int i = PH_FIRST_BYTE; i < PH_COUNT; i++) {
+    // a phase not reached is counted in the next one
+    if (p->phases[i]) {
+      s->phase_sums[i] += p->phases[i] - prev;
+      prev = p->phases[i];
+    }
+  }
+  unsigned long long total = p->phases[PH_CLOSE] - p->phases[PH_FIRST_BYTE];
+  s->count++;
+  s->sum += total;
+  s->buckets[_bucket_index(total)]++;
+  if (total > s->max) {
+    s->max = total;
+  }
+}
+
+// upper bound of the bucket where the quantile falls, in ticks
+static unsigned long long _quantile(RouteStats* s, double q) {
+  if (!s->count) {
+    return 0;
+  }
+  unsigned long long rank = (unsigned long long)(q * s->count);
+  if (rank >= s->count) {
+    rank = s->count - 1;
+  }
+  unsigned long long seen = 0;
+  for (int i = 0; i < BUCKET_COUNT; i++) {
+    seen += s->buckets[i];
+    if (seen > rank) {
+      unsigned long long upper = _bucket_upper(i);
+      return upper < s->max ? upper : s->max;
+    }
+  }
+  return s->max;
+}
+
+static VALUE _stats_hash(RouteStats* s, VALUE label, double freq) {
+  volatile VALUE h = rb_hash_new();
+  VALUE* l = RARRAY_PTR(label);
+  rb_hash_aset(h, ID2SYM(id_method), l[0]);
+  rb_hash_aset(h, ID2SYM(id_prefix), l[1]);
+  rb_hash_aset(h, ID2SYM(id_suffix), l[2]);
+  rb_hash_aset(h, ID2SYM(id_controller), l[3]);
+  rb_hash_aset(h, ID2SYM(id_id), l[4]);
+  rb_hash_aset(h, ID2SYM(id_count), ULL2NUM(s->count));
+
+  volatile VALUE buckets = rb_ary_new();
+  for (int i = 0; i < BUCKET_COUNT; i++) {
+    if (s->buckets[i]) {
+      rb_ary_push(buckets, rb_assoc_new(DBL2NUM(_bucket_upper(i) / freq), ULL2NUM(s->buckets[i])));
+    }
+  }
+  rb_hash_aset(h, ID2SYM(id_sum), DBL2NUM(s->sum / freq));
+  rb_hash_aset(h, ID2SYM(id_max), DBL2NUM(s->max / freq));
+  rb_hash_aset(h, ID2SYM(id_p50), DBL2NUM(_quantile(s, 0.5) / freq));
+  rb_hash_aset(h, ID2SYM(id_p90), DBL2NUM(_quantile(s, 0.9) / freq));
+  rb_hash_aset(h, ID2SYM(id_p99), DBL2NUM(_quantile(s, 0.99) / freq));
+  rb_hash_aset(h, ID2SYM(id_p999), DBL2NUM(_quantile(s, 0.999) / freq));
+
+  volatile VALUE phases = rb_hash_new();
+  for (int i = PH_FIRST_BYTE; i < PH_COUNT; i++) {
+    rb_hash_aset(phases, ID2SYM(rb_intern(phase_names[i])), DBL2NUM(s->phase_sums[i] / freq));
+  }
+  rb_hash_aset(h, ID2SYM(id_phases), phases);
+  rb_hash_aset(h, ID2SYM(id_buckets), buckets);
+  return h;
+}
+
+// latency of registered routes in this process, times are in seconds:
+//
+//   [{method:, prefix:, suffix:, controller:, id:, count:, sum:, max:, p50:, p90:, p99:, p999:,
+//     phases: {wait:, read_header:, read_body:, setup:, action:, send:},
+//     buckets: [[upper_bound, count]]}]
+//
+// buckets with no count are omitted
+static VALUE ext_route_stats(VALUE _) {
+  double freq = nyara_ticks_per_sec();
+  volatile VALUE res = rb_ary_new();
+  for (long i = 0; i < stats_len; i++) {
+    rb_ary_push(res, _stats_hash(stats[i], RARRAY_PTR(stats_labels)[i], freq));
+  }
+  return res;
+}
+
+static VALUE ext_route_stats_reset(VALUE _) {
+  for (long i = 0; i < stats_len; i++) {
+    MEMZERO(stats[i], RouteStats, 1);
+  }
+  return Qnil;
+}
+
+void Init_route_stats(VALUE ext) {
+  init_ticks = rdtsc();
+  init_time = _wall_time();
+
+  stats_labels = rb_ary_new();
+  rb_gc_register_mark_object(stats_labels);
+
+  id_method = rb_intern("method");
+  id_prefix = rb_intern("prefix");
+  id_suffix = rb_intern("suffix");
+  id_controller = rb_intern("controller");
+  id_id = rb_intern("id");
+  id_count = rb_intern("count");
+  id_sum = rb_intern("sum");
+  id_max = rb_intern("max");
+  id_p50 = rb_intern("p50");
+  id_p90 = rb_intern("p90");
+  id_p99 = rb_intern("p99");
+  id_p999 = rb_intern("p999");
+  id_phases = rb_intern("phases");
+  id_buckets = rb_intern("buckets");
+
+  rb_define_singleton_method(ext, "route_stats", ext_route_stats, 0);
+  rb_define_singleton_method(ext, "route_stats_reset", ext_route_stats_reset, 0);
+}
@@ -0,0 +1,91 @@
+/* scoreboard: event loop counters of workers in shared memory
+ *
+ * master maps the board before forking workers, a worker claims a slot and is the only writer of it,
+ * so counters are plain increments without locks. readers (master, admin port) may see a slightly stale slot.
+ * without a shared board (development server, tests) counters go to a local slot.
+ */
+
+#include "nyara.h"
+#include <sys/mman.h>
+#include <signal.h>
+#include <errno.h>
+#include <unistd.h>
+
+#define SCOREBOARD_SLOTS 1024
+
+static ScoreSlot local_slot;
+static ScoreSlot* board = NULL;
+ScoreSlot* nyara_score = &local_slot;
+
+#define SCORE_FIELDS(X) \
+  X(accepts) X(conns) X(sleeping) X(bytes_in) X(bytes_out) X(parse_errors) X(eagain) X(wakeups) X(loops)
+
+static bool _slot_live(ScoreSlot* s) {
+  return s->pid && (kill(s->pid, 0) == 0 || errno == EPERM);
+}
+
+// map the board in master, before forking workers
+static VALUE ext_scoreboard_init(VALUE _) {
+  if (board) {
+    return Qnil;
+  }
+  void* mem = mmap(NULL, sizeof(ScoreSlot) * SCOREBOARD_SLOTS, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANON, -1, 0);
+  if (mem == MAP_FAILED) {
+    rb_sys_fail("mmap(2)");
+  }
+  board = mem; // zero filled
+  return Qnil;
+}
+
+// claim a free slot (or one left by a dead worker) in a forked worker
+static VALUE ext_scoreboard_attach(VALUE _) {
+  if (!board) {
+    return Qfalse;
+  }
+  pid_t pid = getpid();
+  for (int i = 0; i < SCOREBOARD_SLOTS; i++) {
+    pid_t old = board[i].pid;
+    if (old && _slot_live(board + i)) {
+      continue;
+    }
+    if (__sync_bool_compare_and_swap(&board[i].pid, old, pid)) {
+      ScoreSlot* s = board + i;
+#     define RESET(f) s->f = 0;
+      SCORE_FIELDS(RESET);
+#     undef RESET
+      nyara_score = s;
+      return Qtrue;
+    }
+  }
+  return Qfalse;
+}
+
+static VALUE _slot_hash(ScoreSlot* s) {
+  volatile VALUE h = rb_hash_new();
+  rb_hash_aset(h, ID2SYM(rb_intern("pid")), INT2NUM(s->pid ? s->pid : getpid()));
+# define ASET(f) rb_hash_aset(h, ID2SYM(rb_intern(#f)), ULL2NUM(s->f));
+  SCORE_FIELDS(ASET);
+# undef ASET
+  return h;
+}
+
+// [{pid: ..., accepts: ..., ...}] of live workers, or of current process if no shared board
+static VALUE ext_scoreboard(VALUE _) {
+  volatile VALUE res = rb_ary_new();
+  if (!board) {
+    rb_ary_push(res, _slot_hash(&local_slot));
+    return res;
+  }
+  for (int i = 0; i < SCOREBOARD_SLOTS; i++) {
+    if (_slot_live(board + i)) {
+      rb_ary_push(res, _slot_hash(board + i));
+    }
+  }
+  return res;
+}
+
+void Init_scoreboard(VALUE ext) {
+  rb_define_singleton_method(ext, "scoreboard_init", ext_scoreboard_init, 0);
+  rb_define_singleton_method(ext, "scoreboard_attach", ext_scoreboard_attach, 0);
+  rb_define_singleton_method(ext, "scoreboard", ext_scoreboard, 0);
+}
@@ -12,14 +12,39 @@ module Nyara
   # * `x_send_file`  - header field name for `X-Sendfile` or `X-Accel-Redirect`, see [Nyara::Controller#send_file](Controller#send_file.html-instance_method) for details
   # * `session`      - see [Nyara::Session](Session.html) for sub options
   # * `prefer_erb`   - use ERB instead of ERubis for `.erb` templates
-  # * `logger`       - if set, every request is logged, and you can use `Nyara.logger` to do your own logging.
+  # * `logger`       - if set, you can use `Nyara.logger` to do your own logging.
+  # * `access_log`   - if set, every request is logged when its response is finished, by a writer thread in C.
+  #                    `true` for `access.log` under root in production and `STDOUT` in other envs, or a file path.
+  #                    default is `true` if `logger` is set.
+  # * `log_params`   - also log query string and url-encoded body as received, default is `false`.
   # * `before_fork`  - a proc to run before forking
   # * `after_fork`   - a proc to run after forking
   # * `watch`        - if `true`, watch change under project dir and reload automaticly, useful for development. default is `false`.
   #                    if set to a dir name (under project root), watch only changes under the dir.
   # * `watch_assets` - if `true`, watch change with linner (you need `gem install linner` first), useful for development. default is `false`.
   #                    the asset dir to be watched is configured in Linnerfile.
+  # * `reuse_port`   - if `true`, every worker listens on its own `SO_REUSEPORT` socket and is pinned to a CPU,
+  #                    so the kernel spreads connections evenly among workers (production server only). default is `false`.
   # * `timeout`      - after (at least) how many seconds do we delete an inactive request. default is 120.
+  # * `keep_alive`   - max number of requests served in a persistent connection, default is 100.
+  #                    set to `false` to close the connection after every response.
+  # * `keep_alive_timeout` - after (at least) how many idle seconds do we close a persistent connection. default is 5.
+  # * `part_memory_limit`  - max bytes of a multipart part kept in memory, larger parts are written to unlinked temp files
+  #                          under `Dir.tmpdir`, see [Nyara::Part](Part.html). default is 1048576.
+  # * `backlog`      - listen backlog, default is 1000.
+  # * `accept_batch` - max connections a worker accepts in a round of its event loop, default is 64.
+  # * `defer_accept` - seconds for `TCP_DEFER_ACCEPT`, connections are not accepted until data arrives (linux only). default is 0 (disabled).
+  # * `tcp_fastopen` - queue length for `TCP_FASTOPEN`, default is 0 (disabled).
+  # * `tcp_nodelay`  - set `TCP_NODELAY` on connections, default is `false`.
+  # * `sndbuf`, `rcvbuf`   - socket send / receive buffer sizes, default is 0 (system default).
+  #                          these socket options are set on the listener and inherited by accepted connections.
+  # * `read_budget`  - max bytes read from a connection in a round of event loop, the rest is read after other connections are served.
+  #                    default is 262144.
+  # * `cpu_budget`   - microseconds an action runs before `Nyara.yield_if_over_budget` yields to other connections,
+  #                    default is 10000. set to 0 to disable.
+  # * `admin_port`   - if set, master serves scoreboard of workers as plain text on this port of 127.0.0.1 (production server only).
+  # * `event_backend`      - `'epoll'`, `'kqueue'` or `'io_uring'` (if nyara is compiled with liburing),
+  #                          see `Nyara::Ext.event_backends` for available ones. default is the first of them.
   #
   # #### logger example
   #
@@ -70,6 +95,8 @@ module Nyara
       end
 
       self.logger = create_logger
+      self['access_log'] = !!self['logger'] if self['access_log'].nil?
+      self['log_params'] = !!self['log_params']
 
       assert !self['before_fork'] || self['before_fork'].respond_to?('call')
       assert !self['after_fork'] || self['after_fork'].respond_to?('call')
@@ -79,10 +106,73 @@ module Nyara
       assert timeout > 0 && timeout < 2**30
       self['timeout'] = timeout
       Ext.set_inactive_timeout timeout
+
+      keep_alive = self['keep_alive']
+      keep_alive = 100 if keep_alive.nil? or keep_alive == true
+      keep_alive = keep_alive ? keep_alive.to_i : 0
+      assert keep_alive >= 0 && keep_alive < 2**30
+      self['keep_alive'] = keep_alive
+      self['keep_alive_timeout'] ||= 5
+      keep_alive_timeout = self['keep_alive_timeout'].to_i
+      assert keep_alive_timeout > 0 && keep_alive_timeout < 2**30
+      self['keep_alive_timeout'] = keep_alive_timeout
+      Ext.set_keep_alive keep_alive, keep_alive_timeout
+
+      self['part_memory_limit'] ||= 2**20
+      part_memory_limit = self['part_memory_limit'].to_i
+      assert part_memory_limit >= 0
+      self['part_memory_limit'] = part_memory_limit
+      Ext.set_part_memory_limit part_memory_limit, Dir.tmpdir
+
+      %w[backlog defer_accept tcp_fastopen sndbuf rcvbuf].each do |k|
+        n = (self[k] || (k == 'backlog' ? 1000 : 0)).to_i
+        assert n >= 0 && n < 2**31
+        self[k] = n
+      end
+      self['tcp_nodelay'] = !!self['tcp_nodelay']
+
+      self['accept_batch'] ||= 64
+      accept_batch = self['accept_batch'].to_i
+      assert accept_batch > 0 && accept_batch < 2**30
+      self['accept_batch'] = accept_batch
+      Ext.set_accept_batch accept_batch
+
+      self['read_budget'] ||= 262144
+      self['cpu_budget'] ||= 10_000
+      %w[read_budget cpu_budget].each do |k|
+        self[k] = self[k].to_i
+        assert self[k] >= 0
+      end
+      assert self['read_budget'] > 0
+      Ext.set_budget self['read_budget'], self['cpu_budget']
+
+      if self['admin_port']
+        n = self['admin_port'].to_i
+        assert n > 0 && n <= 65535
+        self['admin_port'] = n
+      end
+
+      if self['event_backend']
+        self['event_backend'] = self['event_backend'].to_s
+        assert Ext.event_backends.include?(self['event_backend'])
+      end
     end
 
     attr_accessor :logger
 
+    # Open the IO for access log, or `nil` if disabled
+    def open_access_log
+      case l = self['access_log']
+      when true
+        production? ? File.open(project_path('access.log'), 'a') : STDOUT
+      when String
+        File.open File.expand_path(l, root), 'a'
+      when false, nil
+      else
+        raise 'bad access_log configure, should be: `true` / `false` / path'
+      end
+    end
+
     # Create a logger with the 'logger' option
     def create_logger
       l = self['logger']
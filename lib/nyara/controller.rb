@@ -208,50 +208,44 @@ module Nyara
       end
     end
 
-    def self.dispatch request, instance, args
-      if cookie_str = request.header._aref('Cookie')
-        ParamHash.parse_cookie request.cookie, cookie_str
-      end
-      request.flash = Flash.new(
-        request.session = Session.decode(request.cookie)
-      )
-
-      l = Nyara.logger
+    # Serve request in an action fiber.<br>
+    # Finishing calls (`halt`, `render`, `send_file`, `redirect`...) `throw :term_close`,
+    # so the stack unwinds to here and the fiber can be reused for another request.
+    def self.dispatch request, instance
+      catch :term_close do
+        if cookie_str = request.header_value('Cookie')
+          ParamHash.parse_cookie request.cookie, cookie_str
+        end
+        request.flash = Flash.new(
+          request.session = Session.decode(request.cookie)
+        )
 
-      if instance
-        if l
-          l.info "#{request.http_method} #{request.path} => #{instance.class}"
-          if %W"POST PUT PATCH".include?(request.http_method)
-            l.info "  params: #{instance.params.inspect}"
+        # requests are logged by the C-side access log when response is finished, see config `access_log`
+        if instance
+          Ext.request_invoke_action request # matched action with converted captures
+          return
+        elsif request.http_method == 'GET' and Config['public']
+          path = Config.public_path request.path
+          if File.file?(path)
+            instance = Controller.new request
+            instance.send_file path
+            return
           end
-        end
-        instance.send *args
-        return
-      elsif request.http_method == 'GET' and Config['public']
-        path = Config.public_path request.path
-        if File.file?(path)
-          if l
-            l.info "GET #{request.path} => public 200"
+        elsif Config.development?
+          if process_reload(request, Nyara.logger)
+            Ext.request_send_data request, "HTTP/1.1 200 OK\r\n\r\n"
+            return
           end
-          instance = Controller.new request
-          instance.send_file path
-          return
-        end
-      elsif Config.development?
-        if process_reload(request, l)
-          Ext.request_send_data request, "HTTP/1.1 200 OK\r\n\r\n"
-          return
         end
-      end
 
-      if l
-        l.info "#{request.http_method} #{request.path} => 404"
+        Ext.request_set_status request, 404
+        Ext.request_send_data request, "HTTP/1.1 404 Not Found\r\nConnection: close\r\nContent-Length: 0\r\n\r\n"
       end
-      Ext.request_send_data request, "HTTP/1.1 404 Not Found\r\nConnection: close\r\nContent-Length: 0\r\n\r\n"
-      Fiber.yield :term_close
-
+    rescue Cancelled
+      # client disconnected, the connection is already closed
     rescue Exception
-      instance.handle_error($!) if instance
+      # handle_error may also finish the response with `halt`, `render`...
+      catch(:term_close){ instance.handle_error($!) } if instance
     end
 
     # Path helper
@@ -317,16 +311,19 @@ module Nyara
       end
       uri.scheme = r.ssl? ? 'https' : 'http'
       header['Location'] = uri.to_s
+      header['Content-Length'] = 0
+      header['Connection'] = r.keep_alive? ? 'keep-alive' : 'close'
 
       # similar to send_header, but without content-type
-      Ext.request_send_data r, HTTP_STATUS_FIRST_LINES[r.status]
       data = header.serialize
+      data.unshift HTTP_STATUS_FIRST_LINES[r.status]
       data.concat r.response_header_extra_lines
       data << Session.encode_set_cookie(r.session, r.ssl?)
       data << "\r\n"
-      Ext.request_send_data r, data.join
+      Ext.request_send_data r, data
+      header.freeze
 
-      Fiber.yield :term_close
+      throw :term_close
     end
 
     # Shortcut for `redirect url_to *xs`
@@ -347,7 +344,7 @@ module Nyara
     #     halt
     #
     def halt
-      Fiber.yield :term_close
+      throw :term_close
     end
 
     # Request extension or generated by `Accept`
@@ -454,8 +451,6 @@ module Nyara
       r = request
       header = r.response_header
 
-      Ext.request_send_data r, HTTP_STATUS_FIRST_LINES[r.status]
-
       header.aset_content_type \
         r.response_content_type ||
         header.aref_content_type ||
@@ -464,12 +459,14 @@ module Nyara
         'text/html'
 
       header.reverse_merge! OK_RESP_HEADER
+      header['Connection'] = r.keep_alive? ? 'keep-alive' : 'close'
 
       data = header.serialize
+      data.unshift HTTP_STATUS_FIRST_LINES[r.status]
       data.concat r.response_header_extra_lines
       data << Session.encode_set_cookie(r.session, r.ssl?)
       data << "\r\n"
-      Ext.request_send_data r, data.join
+      Ext.request_send_data r, data # buffered, goes out with the body head in one syscall
 
       # forbid further modification
       header.freeze
@@ -560,30 +557,69 @@ module Nyara
 
       if x_send_file
         header[x_send_file] = file # todo escape name?
+        # the web server sends the file, an empty body framed so the connection can be kept alive
+        header['Content-Length'] = 0
         send_header unless request.response_header.frozen?
       else
-        # todo nonblock read file?
-        data = File.binread file
-        header['Content-Length'] = data.bytesize
-        send_header unless request.response_header.frozen?
-        Ext.request_send_data request, data
+        File.open file, 'rb' do |f|
+          size = f.size # fstat
+          offset = 0
+          length = size
+          if request.status == 200 and !request.response_header.frozen?
+            header['Accept-Ranges'] = 'bytes'
+            range = Controller.byte_range request.header_value('Range'), size
+            if range
+              offset, length = range
+              status 206
+              header['Content-Range'] = "bytes #{offset}-#{offset + length - 1}/#{size}"
+            elsif range == false
+              status 416
+              header['Content-Range'] = "bytes */#{size}"
+              length = 0
+            end
+          end
+          header['Content-Length'] = length
+          send_header unless request.response_header.frozen?
+          Ext.request_send_file request, f.fileno, offset, length
+        end
+      end
+      throw :term_close
+    end
+
+    # Parse a `Range` request header value against a file of `size` bytes.<br>
+    # Returns `[offset, length]`, or `false` if not satisfiable,
+    # or `nil` if the range should be ignored (no range, or multiple ranges which are not supported).
+    def self.byte_range range, size
+      return unless range =~ /\Abytes=\s*(\d*)-(\d*)\s*\z/
+      first = $1
+      last = $2
+      if first.empty?
+        return if last.empty?
+        suffix = last.to_i
+        return false if suffix == 0 or size == 0
+        suffix = size if suffix > size
+        [size - suffix, suffix]
+      else
+        first = first.to_i
+        last = last.empty? ? size - 1 : [last.to_i, size - 1].min
+        return false if first >= size or last < first
+        [first, last - first + 1]
       end
-      Fiber.yield :term_close
     end
 
-    # Resume action after `seconds`
+    # Resume action after `seconds`, or when `request.waker` is called from another thread<br>
+    # If the waker is called before this, returns at once.<br>
+    # NOTE if the client disconnects meanwhile, `Nyara::Cancelled` is raised here, like other points the action waits for IO
     def sleep seconds
       seconds = seconds.to_f
       raise ArgumentError, 'bad sleep seconds' if seconds < 0
 
       # NOTE request_wake requires request as param, so this method can not be generalized to Fiber.sleep
 
-      Ext.request_sleep request # place sleep actions before wake
-      Thread.new do
-        Kernel.sleep seconds
-        Ext.request_wakeup request
+      # scheduled in the timer heap of event loop, false if woken already
+      if Ext.request_sleep request, seconds
+        Ext.fiber_yield :sleep # see event.c for the handler
       end
-      Fiber.yield :sleep # see event.c for the handler
     end
 
     # Render a template as string
@@ -657,7 +693,7 @@ module Nyara
       end
       status 500
       send_header rescue nil
-      # todo send body without Fiber.yield :term_close
+      # todo send body without throw :term_close
     end
   end
 end
@@ -7,6 +7,8 @@ require "cgi"
 require "uri"
 require "openssl"
 require "socket"
+require "stringio"
+require "tmpdir"
 require "tilt"
 require "time"
 require "logger"
@@ -41,7 +43,6 @@ module Nyara
   OK_RESP_HEADER['X-XSS-Protection'] = '1; mode=block'
   OK_RESP_HEADER['X-Content-Type-Options'] = 'nosniff'
   OK_RESP_HEADER['X-Frame-Options'] = 'SAMEORIGIN'
-  OK_RESP_HEADER['Connection'] = 'close'
 
   START_CTX = {
     0 => $0.dup,
@@ -69,6 +70,21 @@ module Nyara
       RUBY
     end
 
+    # Call this in a CPU heavy action now and then, if the action has run longer than `cpu_budget` since resumed,
+    # it yields to the event loop and continues after events of other connections are handled.<br>
+    # Returns `true` if it yielded.
+    #
+    # #### Example
+    #
+    #     rows.each_slice 100 do |slice|
+    #       process slice
+    #       Nyara.yield_if_over_budget
+    #     end
+    #
+    def yield_if_over_budget
+      Ext.yield_if_over_budget
+    end
+
     def setup
       Session.init
       Config.init
@@ -138,6 +154,14 @@ module Nyara
     # * `TTIN`  - increase worker number
     # * `TTOUT` - decrease worker number
     #
+    # Scoreboard of workers is served on config `admin_port`, for example
+    #
+    #     curl localhost:3001
+    #
+    # Worker signals:
+    #
+    # * `USR1`  - print number of accepted connections of the worker, useful for checking load balance with `reuse_port`
+    #
     # To make a graceful hot-restart:
     #
     # 1. USR2 -> old master
@@ -147,6 +171,7 @@ module Nyara
     #
     # * NOTE in step 2/3 if an additional fork executed in new master and hangs,<br>
     #   you may need send an additional INT to terminate it.
+    # * NOTE with `reuse_port` there's no listener to hand off, new workers listen on the same port with their own sockets.
     # * NOTE hot-restart reloads almost everything, including Gemfile changes and configures except port.<br>
     #   but, if some critical environment variable or port configure needs change, you still need cold-restart.
     # * TODO write to a file to show workers are good
@@ -155,7 +180,10 @@ module Nyara
       workers = Config[:workers]
 
       puts "workers: #{workers}"
-      create_tcp_server port
+      # with reuse_port, every worker creates its own listener
+      create_tcp_server port unless Config['reuse_port']
+      Ext.scoreboard_init
+      start_admin_server Config['admin_port'] if Config['admin_port']
 
       GC.start
       @workers = []
@@ -181,8 +209,86 @@ module Nyara
       Process.waitall
     end
 
+    # Counters of live workers, see [Nyara::Ext.scoreboard]
+    def scoreboard
+      Ext.scoreboard
+    end
+
+    # @private
+    PROMETHEUS_BUCKETS = [0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10]
+
+    # Latency histograms of routes served by this worker, in Prometheus text format.
+    # see [Nyara::Ext.route_stats] for the raw data. to expose it, for example
+    #
+    #     get '/metrics' do
+    #       content_type 'txt'
+    #       send_string Nyara.route_stats_text
+    #     end
+    #
+    def route_stats_text
+      duration = "nyara_request_duration_seconds"
+      phase = "nyara_request_phase_seconds_total"
+      lines = [
+        "# HELP #{duration} Time from the first byte of request to the response finished.",
+        "# TYPE #{duration} histogram"
+      ]
+      phase_lines = [
+        "# HELP #{phase} Time spent in request phases, summed.",
+        "# TYPE #{phase} counter"
+      ]
+      Ext.route_stats.each do |s|
+        labels = %Q|method="#{s[:method]}",controller="#{s[:controller]}",action="#{s[:id]}"|
+        buckets = s[:buckets]
+        PROMETHEUS_BUCKETS.each do |le|
+          n = buckets.inject(0){|acc, (upper, count)| upper <= le ? acc + count : acc }
+          lines << %Q|#{duration}_bucket{#{labels},le="#{le}"} #{n}|
+        end
+        lines << %Q|#{duration}_bucket{#{labels},le="+Inf"} #{s[:count]}|
+        lines << "#{duration}_sum{#{labels}} #{s[:sum]}"
+        lines << "#{duration}_count{#{labels}} #{s[:count]}"
+        s[:phases].each do |name, secs|
+          phase_lines << %Q|#{phase}{#{labels},phase="#{name}"} #{secs}|
+        end
+      end
+      (lines + phase_lines).join("\n") + "\n"
+    end
+
     private
 
+    # One line for a worker, and a line for the total
+    def scoreboard_text
+      board = Ext.scoreboard
+      total = Hash.new 0
+      lines = board.map do |slot|
+        slot.each{|k, v| total[k] += v unless k == :pid }
+        slot.map{|k, v| "#{k}=#{v}" }.join(' ')
+      end
+      lines << "total " + total.map{|k, v| "#{k}=#{v}" }.join(' ')
+      lines.join("\n") + "\n"
+    end
+
+    # Serve scoreboard as plain text on a local port, the listener is inherited by a hot-restarted master like the main one
+    def start_admin_server port
+      if (fd = ENV['NYARA_ADMIN_FD'].to_i) > 0
+        @admin_server = TCPServer.for_fd fd
+      else
+        @admin_server = TCPServer.new '127.0.0.1', port
+        ENV['NYARA_ADMIN_FD'] = @admin_server.fileno.to_s
+      end
+      server = @admin_server
+      Thread.new do
+        loop do
+          conn = server.accept
+          begin
+            conn.write "HTTP/1.0 200 OK\r\nContent-Type: text/plain\r\nConnection: close\r\n\r\n" + scoreboard_text
+          rescue SystemCallError
+          ensure
+            conn.close
+          end
+        end
+      end
+    end
+
     def reconfig_with_command_line_options argv=ARGV.dup
       until argv.empty?
         case opt = argv.shift
@@ -209,11 +315,27 @@ module Nyara
       end
       unless @server
         @server = TCPServer.new '0.0.0.0', port
-        @server.listen 1000
+        tune_listener @server
         ENV['NYARA_FD'] = @server.fileno.to_s
       end
     end
 
+    # Listener owned by a single worker, kernel distributes connections among them
+    def create_reuse_port_server port
+      server = Socket.new :INET, :STREAM
+      server.setsockopt :SOCKET, :REUSEADDR, true
+      server.setsockopt :SOCKET, :REUSEPORT, true
+      server.bind Addrinfo.tcp('0.0.0.0', port)
+      tune_listener server
+      server
+    end
+
+    # Apply listener options in config and listen with `backlog`
+    def tune_listener server
+      Ext.tune_listener server.fileno, Config['backlog'], Config['defer_accept'], Config['tcp_fastopen'],
+        Config['tcp_nodelay'], Config['sndbuf'], Config['rcvbuf']
+    end
+
     # Kill all workers and exit
     def kill_all sig
       @workers.each do |w|
@@ -234,7 +356,13 @@ module Nyara
     # Spawn a new master
     def spawn_new_master sig
       fork do
-        @server.close_on_exec = false
+        @admin_server.close_on_exec = false if @admin_server
+        if @server
+          @server.close_on_exec = false
+        else
+          # with reuse_port, workers of the new master bind their own listeners beside the old ones
+          ENV.delete 'NYARA_FD'
+        end
         reload_all
       end
     end
@@ -270,24 +398,40 @@ module Nyara
     # Increase worker number by 1
     def incr_workers sig
       Config['before_fork'].call if Config['before_fork']
+      worker_index = @workers.size
       pid = fork {
+        # no shared listener only in production server with reuse_port, development server always binds one
+        unless @server
+          @server = create_reuse_port_server Config['port']
+          Ext.set_cpu_affinity worker_index % CpuCounter.count
+        end
+        # only master serves it
+        @admin_server.close if @admin_server
+        Ext.scoreboard_attach
+        if @access_log = Config.open_access_log
+          Ext.access_log_open @access_log.fileno, Config['log_params']
+        end
         patch_tcp_socket
         $0 = "(nyara:worker) ruby #{$0}"
         Config['after_fork'].call if Config['after_fork']
 
-        trap :QUIT do
-          Ext.graceful_quit @server.fileno
+        # the event loop closes @server
+        quit = proc do
+          Ext.graceful_quit
         end
+        trap :QUIT, &quit
+        trap :TERM, &quit
 
-        trap :TERM do
-          Ext.graceful_quit @server.fileno
+        trap :USR1 do
+          puts "worker #{Process.pid} accepted #{Ext.accept_count} connections, #{Ext.disconnect_count} disconnected by client, #{Ext.cancel_count} actions cancelled"
         end
 
         t = Thread.new do
-          Ext.init_queue
+          Ext.init_queue Config['event_backend']
           Ext.run_queue @server.fileno
         end
         t.join
+        Ext.access_log_close
       }
       @workers << pid
     end
@@ -47,6 +47,7 @@ module Nyara
     # * `mechanism` - 7bit, 8bit, binary, base64, or quoted-printable
     # * `type`      - mime type
     # * `data`      - decoded data (incomplete before Part#final called)
+    # * `tempfile`  - unlinked temp file holding the decoded data instead of `data`, when the part exceeds config `part_memory_limit`
     # * `filename`  - basename of uploaded data
     # * `name`      - param name, in array form. If it comes like `a[b][][c]`, then it becomes `["a", "b", "", "c"]` after parsing.
     #
@@ -107,16 +108,26 @@ module Nyara
       elsif self['type']
         warn "looks like bad part: #{self['header'].inspect}"
       else
-        params.send :nested_aset, keys, CGI.unescape(self['data'])
+        params.send :nested_aset, keys, CGI.unescape(read)
       end
     end
 
+    # Append data, used when the part is not parsed by the C-ext<br>
+    # NOTE parts in requests are decoded and stored in C, see `ext/part_decode.c`
+    #
     # #### Params
     #
     # - `raw` in binary encoding
     #
     # NOTE close connection on error
     def update raw
+      self['data'] << decode(raw)
+    end
+
+    # Decode `raw` with the transfer mechanism, the incomplete tail is kept for the next call
+    #
+    # NOTE close connection on error
+    def decode raw
       case self['mechanism']
       when 'base64'
         # rfc2045#section-6.8
@@ -126,51 +137,81 @@ module Nyara
         end
         # last part can be at most 4 bytes and 2 '='s
         size = raw.bytesize - 6
+        res = ''.force_encoding('binary')
         if size >= 4
           size = size / 4 * 4
-          self['data'] << raw.slice!(0...size).unpack('m').first
+          res = raw.slice!(0...size).unpack('m').first
         end
         self['tmp'] = raw
+        res
 
       when 'quoted-printable'
         # http://en.wikipedia.org/wiki/Quoted-printable
         if self['tmp']
           raw = (self['tmp'] << raw)
         end
+        res = ''.force_encoding('binary')
         if i = raw.rindex("\r\n")
-          s = raw.slice! i
-          s.gsub!(/=(?:(\h\h)|\r\n)/n) do
+          res = raw.slice! i
+          res.gsub!(/=(?:(\h\h)|\r\n)/n) do
             [$1].pack 'H*'
           end
-          self['data'] << s
         end
         self['tmp'] = raw
+        res
 
       else # '7bit', '8bit', 'binary', ...
-        self['data'] << raw
+        raw
       end
     end
 
     # NOTE close connection on error
     def final
-      case self['mechanism']
-      when 'base64'
-        if tmp = self['tmp']
-          self['data'] << tmp.unpack('m').first
-          delete 'tmp'
-        end
-
-      when 'quoted-printable'
-        if tmp = self['tmp']
-          self['data'] << tmp.gsub(/=(\h\h)|=\r\n/n) do
+      tmp = delete 'tmp'
+      if tmp
+        case self['mechanism']
+        when 'base64'
+          tmp = tmp.unpack('m').first
+        when 'quoted-printable'
+          tmp = tmp.gsub(/=(\h\h)|=\r\n/n) do
             [$1].pack 'H*'
           end
-          delete 'tmp'
         end
       end
+
+      if file = self['tempfile']
+        file.write tmp if tmp
+        file.rewind
+      elsif tmp
+        self['data'] << tmp
+      end
       self
     end
 
+    # An IO for reading part data, the tempfile if the part is too large to keep in memory
+    def io
+      if file = self['tempfile']
+        file.rewind
+        file
+      else
+        StringIO.new self['data']
+      end
+    end
+
+    # Data size in bytes
+    def size
+      if file = self['tempfile']
+        file.size
+      else
+        self['data'].bytesize
+      end
+    end
+
+    # Read all data into a string
+    def read
+      io.read
+    end
+
     # @private
     def enc_unescape enc, v # :nodoc:
       enc = (Encoding.find enc rescue nil)
@@ -186,6 +227,8 @@ module Nyara
       each do |k, v|
         if k == 'data'
           h[k] = "#{v.bytesize}:#{v[0..5]}..."
+        elsif k == 'tempfile'
+          h[k] = "#{v.size}:#{v.inspect}"
         else
           h[k] = v
         end
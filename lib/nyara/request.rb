@@ -3,7 +3,8 @@
 module Nyara
   # Request and handler
   class Request
-    # c-ext: http_method, scope, path, query, path_with_query format, accept, header
+    # c-ext: http_method, scope, path, query, path_with_query format, accept, header, header_value
+    #        read_body_chunk, read_part
     #        cookie, session, flash
     #        status, response_content_type, response_header, response_header_extra_lines
     # todo: body, move all underline methods into Ext
@@ -25,19 +26,18 @@ module Nyara
     %w[content_length content_type referrer user_agent].each do |m|
       eval <<-RUBY
         def #{m}
-          header["#{m.split('_').map(&:capitalize).join '-'}"]
+          header_value "#{m.split('_').map(&:capitalize).join '-'}"
         end
       RUBY
     end
 
     def scheme
       @scheme ||= begin
-        h = header
-        if h['X-Forwarded-Ssl'] == 'on'
+        if header_value('X-Forwarded-Ssl') == 'on'
           'https'
-        elsif s = h['X-Forwarded-Scheme']
+        elsif s = header_value('X-Forwarded-Scheme')
           s
-        elsif s = h['X-Forwarded-Proto']
+        elsif s = header_value('X-Forwarded-Proto')
           s.split(',')[0]
         else
           'http'
@@ -51,7 +51,7 @@ module Nyara
 
     def domain
       @domain ||= begin
-        r = header['Host']
+        r = header_value('Host')
         if r
           r.split(':', 2).first
         else
@@ -62,7 +62,7 @@ module Nyara
 
     def port
       @port ||= begin
-        r = header['Host']
+        r = header_value('Host')
         if r
           r = r.split(':', 2).last
         end
@@ -71,7 +71,7 @@ module Nyara
     end
 
     def host_with_port
-      header['Host'] || begin
+      header_value('Host') || begin
         p = port
         if p == 80
           domain
@@ -82,19 +82,19 @@ module Nyara
     end
 
     def xhr?
-      header["Requested-With"] == "XMLHttpRequest"
+      header_value("Requested-With") == "XMLHttpRequest"
     end
 
     def accept_language
-      @accept_language ||= Ext.parse_accept_value header['Accept-Language']
+      @accept_language ||= Ext.parse_accept_value header_value('Accept-Language')
     end
 
     def accept_charset
-      @accept_charset ||= Ext.parse_accept_value header['Accept-Charset']
+      @accept_charset ||= Ext.parse_accept_value header_value('Accept-Charset')
     end
 
     def accept_encoding
-      @accept_encoding ||= Ext.parse_accept_value header['Accept-Encoding']
+      @accept_encoding ||= Ext.parse_accept_value header_value('Accept-Encoding')
     end
 
     FORM_METHODS = %w[
@@ -110,7 +110,7 @@ module Nyara
     ]
 
     def form?
-      if type = header['Content-Type']
+      if type = header_value('Content-Type')
         type = type[/[^;\s]+/]
         FORM_METHODS.include?(http_method) and
         FORM_MEDIA_TYPES.include?(type)
@@ -139,6 +139,55 @@ module Nyara
       end
     end
 
+    # Yield body data chunk by chunk as they are received, the connection is not read until the block returns.<br>
+    # NOTE body data yielded here is not kept in `body`, so `param` can not parse it
+    #
+    # #### Example
+    #
+    #     request.each_body_chunk do |chunk|
+    #       storage.write chunk
+    #     end
+    #
+    def each_body_chunk
+      while chunk = read_body_chunk
+        yield chunk
+      end
+    end
+
+    # Yield [Nyara::Part](Part.html)s of multipart body as they are completed, the connection is not read until the block returns.<br>
+    # NOTE parts yielded here are not kept in `body`, so `param` can not merge them
+    def each_part
+      while part = read_part
+        yield part
+      end
+    end
+
+    # A proc resuming the action sleeping in [Controller#sleep](Controller.html#sleep-instance_method) before time is up.<br>
+    # Safe to call from any thread (e.g. a callback of DB driver), the action is resumed in the event loop thread at once.
+    # If the action is not sleeping yet, its next `sleep` returns at once.<br>
+    # The proc is bound to the current request, calling it after the request is finished does nothing,
+    # even if this object is reused for a later request.
+    #
+    # #### Example
+    #
+    #     get '/slow' do
+    #       wake = request.waker
+    #       result = nil
+    #       db.query_async(sql){|res| result = res; wake.call }
+    #       sleep 10 # timeout
+    #       send_string result.to_s
+    #     end
+    #
+    def waker
+      gen = Ext.request_gen self
+      proc{ Ext.request_wakeup self, gen }
+    end
+
+    # Same as `waker.call`, for use while the request is being served
+    def wakeup
+      Ext.request_wakeup self, Ext.request_gen(self)
+    end
+
     def inspect
       "#<Nyara::Request%s>" %
         instance_variables.map { |iv|
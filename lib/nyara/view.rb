@@ -321,7 +321,7 @@ module Nyara
 
     def render
       @instance.send_chunk @layout_render.call *@args
-      Fiber.yield :term_close
+      throw :term_close
     end
 
     def stream
@@ -334,10 +334,11 @@ module Nyara
 
     def resume
       r = @fiber.resume
-      Fiber.yield r if r
+      Ext.fiber_yield r if r
       unless @out.empty?
         @out.flush @instance
       end
+      Ext.request_flush @instance.request
     end
 
     def end
@@ -345,7 +346,7 @@ module Nyara
         resume
       end
       @instance.send_chunk @rest_result
-      Fiber.yield :term_close
+      throw :term_close
     end
   end
 end
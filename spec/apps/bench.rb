@@ -0,0 +1,34 @@
+# sample app driven by `rake bench`, each route stresses a different layer
+
+require_relative "../../lib/nyara"
+require "slim"
+
+configure do
+  set :env, 'production'
+  set :port, (ENV['NYARA_BENCH_PORT'] || 3005).to_i
+  set :workers, (ENV['NYARA_BENCH_WORKERS'] || 1).to_i
+  set :root, File.expand_path('..', __dir__)
+  set :views, 'performance'
+  set :logger, false
+  set :access_log, false
+  set :keep_alive, 1_000_000
+end
+
+Item = Struct.new :name, :price
+ITEMS = 10.times.map{|i| Item.new "name#{i}", i }
+
+# event loop and response writing
+get '/' do
+  send_string 'hello'
+end
+
+# route lookup with typed captures
+get '/users/%u/posts/%s' do |user_id, slug|
+  send_string "#{user_id}:#{slug}"
+end
+
+# view layer, the same templates as layout_render.rb
+get '/render' do
+  @title = 'bench'
+  render 'page.slim', layout: ['layout.slim', 'layout.slim'], locals: {items: ITEMS}
+end
@@ -43,6 +43,29 @@ module Nyara
       assert_equal 12, Config['timeout']
     end
 
+    it "keep_alive default" do
+      Config.init
+      assert_equal 100, Config['keep_alive']
+      assert_equal 5, Config['keep_alive_timeout']
+
+      Config['keep_alive'] = false
+      Config.init
+      assert_equal 0, Config['keep_alive']
+    end
+
+    it "listener options default" do
+      Config.init
+      assert_equal 1000, Config['backlog']
+      assert_equal 64, Config['accept_batch']
+      assert_equal 0, Config['defer_accept']
+      assert_equal false, Config['tcp_nodelay']
+
+      Config['accept_batch'] = 0
+      assert_raise ArgumentError do
+        Config.init
+      end
+    end
+
     it "views, assets and public default" do
       Config[:root] = __dir__
       Config.init
@@ -30,6 +30,18 @@ module Nyara
       assert_equal 'll', AChildController.default_layout
     end
 
+    it ".byte_range" do
+      assert_equal nil, Controller.byte_range(nil, 10)
+      assert_equal nil, Controller.byte_range('bytes=1-2,4-5', 10)
+      assert_equal [1, 2], Controller.byte_range('bytes=1-2', 10)
+      assert_equal [3, 7], Controller.byte_range('bytes=3-', 10)
+      assert_equal [7, 3], Controller.byte_range('bytes=-3', 10)
+      assert_equal [0, 10], Controller.byte_range('bytes=-30', 10)
+      assert_equal [5, 5], Controller.byte_range('bytes=5-100', 10)
+      assert_equal false, Controller.byte_range('bytes=10-', 10)
+      assert_equal false, Controller.byte_range('bytes=3-2', 10)
+    end
+
     context "generate additional routes" do
       it "GET -> HEAD" do
         routes = DummyController.nyara_compile_routes '/'
@@ -88,5 +88,40 @@ module Nyara
       scope, _, args = Ext.lookup_route 'GET', '/a目录/2013-6-1', nil
       assert_equal [:'#dir', 2013, 6, 1], args
     end
+
+    it '#lookup_route with typed segments and regexp fallback' do
+      Ext.clear_route
+      routes = [
+        ['/f/', '^([-+]?(?:0[xX](?:\.\h+|\h+(?:\.\h*)?)[pP][-+]\d+|\d+(?![\d.])|\d*\.\d*(?:[eE][-+]?\d+)?))$', [:to_f]],
+        ['/s/', '^([^/]+)\-([^/]+)$', [:to_s, :to_s]],
+        ['/r/', '^(a|b)$', [:to_s]],
+        ['/', '^(\h+)$', [:hex]]
+      ]
+      routes.each_with_index do |(prefix, suffix, conv), i|
+        Ext.register_route Route.new{
+          @http_method = 'GET'
+          @scope = '/'
+          @prefix = prefix
+          @suffix = suffix
+          @id = :"##{i}"
+          @conv = conv
+          @controller = 'stub'
+        }
+      end
+
+      _, _, args = Ext.lookup_route 'GET', '/f/-1.5e3', nil
+      assert_equal [:'#0', -1500.0], args
+      _, _, args = Ext.lookup_route 'GET', '/f/0x1p3', nil
+      assert_equal :'#0', args.first
+      _, _, args = Ext.lookup_route 'GET', '/s/a-b-c', nil
+      assert_equal [:'#1', 'a-b', 'c'], args
+      _, _, args = Ext.lookup_route 'GET', '/r/b', nil
+      assert_equal [:'#2', 'b'], args
+      # falls to shorter prefix
+      _, _, args = Ext.lookup_route 'GET', '/ff', nil
+      assert_equal [:'#3', 255], args
+      _, cont, _ = Ext.lookup_route 'GET', '/s/a', nil
+      assert_equal nil, cont
+    end
   end
 end
@@ -1,5 +1,7 @@
 require_relative "spec_helper"
 require 'logger'
+require 'tempfile'
+require 'timeout'
 
 class TestController < Nyara::Controller
   attr_reader :before_invoked
@@ -25,10 +27,26 @@ class TestController < Nyara::Controller
     # no response
   end
 
+  post '/each_body_chunk' do
+    chunks = []
+    request.each_body_chunk{|chunk| chunks << chunk }
+    send_string chunks.join
+  end
+
+  post '/each_part' do
+    names = []
+    request.each_part{|part| names << part['name'] }
+    send_string names.join(',')
+  end
+
   put '/send_file/%z' do |name|
     send_file Nyara.config.views_path name
   end
 
+  put '/x_send_file/%z' do |name|
+    send_file Nyara.config.views_path(name), x_send_file: 'X-Sendfile'
+  end
+
   delete '/render' do
     render 'edit.slim'
   end
@@ -48,6 +66,40 @@ class TestController < Nyara::Controller
   options '/error' do
     raise 'error'
   end
+
+  options '/error-render' do
+    raise 'render in handle_error'
+  end
+
+  options '/error-halt' do
+    raise 'halt in handle_error'
+  end
+
+  def handle_error e
+    case e.message
+    when 'render in handle_error'
+      status 503
+      render 'edit.slim'
+    when 'halt in handle_error'
+      status 503
+      send_header
+      halt
+    else
+      super
+    end
+  end
+
+  get '/sleep' do
+    sleep 0.05
+    send_string 'slept'
+  end
+
+  get '/wake-before-sleep' do
+    $waker = request.waker
+    $waker.call
+    sleep 5
+    send_string 'woken'
+  end
 end
 
 class MyTest
@@ -85,6 +137,24 @@ module Nyara
       assert_equal 'text/plain; charset=UTF-8', @test.response.header['Content-Type']
     end
 
+    it "records route stats" do
+      Ext.route_stats_reset
+      2.times{ @test.get "/" }
+      s = Ext.route_stats.find{|r| r[:controller] == TestController && r[:id] == :'#index' }
+      assert_equal 2, s[:count]
+      assert_equal 2, s[:buckets].map(&:last).inject(:+)
+      assert s[:p99] <= s[:max]
+      assert s[:phases][:action] > 0
+      assert_include Nyara.route_stats_text, %Q|nyara_request_duration_seconds_count{method="GET",controller="TestController",action="#index"} 2|
+    end
+
+    it "does not count served requests as parse errors" do
+      parse_errors = Nyara.scoreboard.first[:parse_errors]
+      2.times{ @test.get "/" }
+      assert @test.response.success?
+      assert_equal parse_errors, Nyara.scoreboard.first[:parse_errors]
+    end
+
     it "redirect" do
       @test.post @test.path_to('test#create')
       assert_equal 'This is a partial 1', @test.response.header['Partial']
@@ -96,10 +166,17 @@ module Nyara
 
     it "post params log output" do
       data = { name: 1, sex: 0 }
-      Nyara.config.stub(:logger).and_return(Logger.new($stdout))
-      out = capture(:stdout) { @test.post @test.path_to('test#create'), {}, data }
-      # puts out
-      assert_include out, 'params: {"name"=>"1", "sex"=>"0"}'
+      log = Tempfile.new 'access_log'
+      begin
+        Ext.access_log_open log.fileno, true
+        @test.post @test.path_to('test#create'), {}, data
+        Ext.access_log_close
+        out = File.read log.path
+      ensure
+        log.close!
+      end
+      assert_include out, 'POST /create 302 '
+      assert_include out, 'body: name=1&sex=0'
     end
 
     it "session continuation" do
@@ -118,6 +195,24 @@ module Nyara
       assert_equal data, @test.response.body
     end
 
+    it "send_file with range" do
+      data = File.read Nyara.config.views_path('layout.erb')
+      @test.put "/send_file/layout.erb", 'Range' => 'bytes=2-5'
+      assert_equal 206, @test.response.status
+      assert_equal data[2..5], @test.response.body
+      assert_equal "bytes 2-5/#{data.bytesize}", @test.response.header['Content-Range']
+
+      @test.put "/send_file/layout.erb", 'Range' => "bytes=#{data.bytesize}-"
+      assert_equal 416, @test.response.status
+    end
+
+    it "send_file with x_send_file" do
+      @test.put "/x_send_file/layout.erb"
+      assert_equal Nyara.config.views_path('layout.erb'), @test.response.header['X-Sendfile']
+      assert_equal '0', @test.response.header['Content-Length']
+      assert_empty @test.response.body
+    end
+
     it "render" do
       @test.delete "/render"
       assert_include @test.response.body, "slim:edit"
@@ -140,6 +235,15 @@ module Nyara
       assert_equal false, @test.response.success?
     end
 
+    it "finishes response in handle_error" do
+      @test.options '/error-render'
+      assert_equal 503, @test.response.status
+      assert_include @test.response.body, "slim:edit"
+
+      @test.options '/error-halt'
+      assert_equal 503, @test.response.status
+    end
+
     it "multipart upload" do
       data = File.binread(__dir__ + '/raw_requests/multipart')
       @test.env.process_request_data data
@@ -149,6 +253,176 @@ module Nyara
       assert_equal 'baz', param['baz']['你好']['data']
     end
 
+    it "cancels action when client disconnects" do
+      client, server = Socket.pair :UNIX, :STREAM
+      request = Ext.request_new
+      Ext.request_set_fd request, server.fileno
+      disconnect_count = Ext.disconnect_count
+      cancel_count = Ext.cancel_count
+
+      # action waits for the rest of body
+      client << "POST /upload HTTP/1.1\r\nContent-Length: 100\r\n\r\nfoo"
+      Ext.handle_request request
+      assert_equal cancel_count, Ext.cancel_count
+
+      client.close
+      Ext.handle_request request
+      assert_equal disconnect_count + 1, Ext.disconnect_count
+      assert_equal cancel_count + 1, Ext.cancel_count
+    ensure
+      Ext.request_unset_fd request
+      server.close
+    end
+
+    it "does not count closing an idle connection as disconnect" do
+      client, server = Socket.pair :UNIX, :STREAM
+      request = Ext.request_new
+      Ext.request_set_fd request, server.fileno
+      disconnect_count = Ext.disconnect_count
+
+      client.close
+      Ext.handle_request request
+      assert_equal disconnect_count, Ext.disconnect_count
+    ensure
+      Ext.request_unset_fd request
+      server.close
+    end
+
+    it "keeps a wakeup before sleep, and drops it after the request" do
+      t = Time.now
+      @test.get '/wake-before-sleep'
+      assert Time.now - t < 1
+      assert_equal 'woken', @test.response.body
+      assert_equal false, $waker.call
+    end
+
+    # run the event loop in a forked worker, yields the port
+    def with_worker backend = nil, keep_alive: nil
+      server = TCPServer.new '127.0.0.1', 0
+      pid = fork do
+        Ext.set_keep_alive keep_alive, Config['keep_alive_timeout'] if keep_alive
+        Ext.init_queue backend
+        Ext.run_queue server.fileno
+      end
+      yield server.addr[1]
+    ensure
+      Process.kill :KILL, pid
+      Process.wait pid
+      server.close
+    end
+
+    # read [n] chunked responses from a kept-alive connection
+    def read_responses conn, n = 1
+      res = ''.b
+      Timeout.timeout 5 do
+        res << conn.readpartial(4096) while res.scan("\r\n0\r\n\r\n").size < n
+      end
+      res.force_encoding 'utf-8'
+    end
+
+    # Ext.handle_request serves one request per connection, keep-alive needs the event loop
+    it "serves keep-alive and pipelined requests" do
+      with_worker do |port|
+        conn = TCPSocket.new '127.0.0.1', port
+        2.times do
+          conn << "GET / HTTP/1.1\r\nHost: localhost\r\n\r\n"
+          res = read_responses conn
+          assert_include res, 'Connection: keep-alive'
+          assert_include res, '初めまして from test'
+        end
+
+        conn << "GET / HTTP/1.1\r\nHost: localhost\r\n\r\nGET /sleep HTTP/1.1\r\nHost: localhost\r\n\r\n"
+        res = read_responses conn, 2
+        assert res.index('初めまして from test') < res.index('slept')
+        conn.close
+      end
+    end
+
+    it "closes the connection after keep_alive requests" do
+      with_worker nil, keep_alive: 2 do |port|
+        conn = TCPSocket.new '127.0.0.1', port
+        conn << "GET / HTTP/1.1\r\nHost: localhost\r\n\r\n"
+        assert_include read_responses(conn), 'Connection: keep-alive'
+        conn << "GET / HTTP/1.1\r\nHost: localhost\r\n\r\n"
+        assert_include read_responses(conn), 'Connection: close'
+        assert_empty Timeout.timeout(5){ conn.read }
+        conn.close
+      end
+    end
+
+    it "serves a half-closed client" do
+      with_worker do |port|
+        conn = TCPSocket.new '127.0.0.1', port
+        # the eof arrives while the action sleeps
+        conn << "GET /sleep HTTP/1.1\r\nHost: localhost\r\n\r\n"
+        conn.close_write
+        res = Timeout.timeout(5){ conn.read }
+        conn.close
+        assert_include res, 'HTTP/1.1 200'
+        assert_include res, 'slept'
+      end
+    end
+
+    # the backend is compiled only when liburing is found
+    if Ext.event_backends.include?('io_uring')
+      it "serves keep-alive and closed connections with io_uring backend" do
+        with_worker 'io_uring' do |port|
+          # closed fds are reused by the next connections
+          20.times do
+            conn = TCPSocket.new '127.0.0.1', port
+            conn << "GET / HTTP/1.1\r\nHost: localhost\r\n\r\n"
+            conn << "GET / HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\n\r\n"
+            res = Timeout.timeout(5){ conn.read }
+            conn.close
+            assert_equal 2, res.force_encoding('utf-8').scan('初めまして from test').size
+          end
+        end
+      end
+    end
+
+    it "streams body chunks" do
+      @test.post "/each_body_chunk", {'Content-Type' => 'text/plain'}, 'hello world'
+      assert_equal 'hello world', @test.response.body
+    end
+
+    it "streams multipart parts" do
+      data = File.binread(__dir__ + '/raw_requests/multipart').sub '/upload', '/each_part'
+      @test.env.process_request_data data
+      assert_equal 'bar,baz[你好],foo'.b, @test.env.response.body.b
+    end
+
+    it "multipart upload spills large parts to temp files" do
+      Ext.set_part_memory_limit 2, Dir.tmpdir
+      data = File.binread(__dir__ + '/raw_requests/multipart')
+      @test.env.process_request_data data
+      param = @test.env.request.param
+      assert_equal 'foo', param['foo']
+      assert_nil param['bar']['data']
+      assert_equal 3, param['bar'].size
+      assert_equal 'bar', param['bar']['tempfile'].read
+      assert_equal 'baz', param['baz']['你好'].read
+    ensure
+      Ext.set_part_memory_limit Config['part_memory_limit'], Dir.tmpdir
+    end
+
+    it "closes the connection when a part can't be spilled" do
+      Ext.set_part_memory_limit 2, Dir.tmpdir + '/nyara-missing-dir'
+      client, server = Socket.pair :UNIX, :STREAM
+      request = Ext.request_new
+      Ext.request_set_fd request, server.fileno
+      parse_errors = Nyara.scoreboard.first[:parse_errors]
+
+      client << File.binread(__dir__ + '/raw_requests/multipart')
+      Ext.handle_request request
+      assert_equal parse_errors + 1, Nyara.scoreboard.first[:parse_errors]
+      # no response is sent
+      assert_empty (client.read_nonblock 100 rescue '')
+    ensure
+      Ext.request_unset_fd request
+      server.close
+      Ext.set_part_memory_limit Config['part_memory_limit'], Dir.tmpdir
+    end
+
     context "public static content" do
       it "found file" do
         @test.get "/index.html"
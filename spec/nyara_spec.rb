@@ -40,4 +40,24 @@ describe Nyara do
       end
     end
   end
+
+  context ".scoreboard_text" do
+    it "lists counters of the worker and total" do
+      lines = Nyara.send(:scoreboard_text).lines
+      assert_equal Nyara.scoreboard.size + 1, lines.size
+      assert_include lines.first, "pid=#{Process.pid}"
+      assert_include lines.last, "total accepts="
+    end
+  end
+
+  context ".create_reuse_port_server" do
+    it "allows multiple listeners on the same port" do
+      s1 = Nyara.send :create_reuse_port_server, 0
+      port = s1.local_address.ip_port
+      s2 = Nyara.send :create_reuse_port_server, port
+      assert_equal port, s2.local_address.ip_port
+      s1.close
+      s2.close
+    end
+  end
 end
@@ -0,0 +1,39 @@
+require_relative "performance_helper"
+
+include Nyara
+
+# A/B of compiled event backends on loopback: concurrent keep-alive connections
+# against a forked worker, result is used time per backend
+class EventBackendController < Controller
+  get '/' do
+    send_string 'ok'
+  end
+end
+
+serve EventBackendController
+
+CONNECTIONS = 16
+REQUESTS = 300
+
+def bench backend
+  with_worker backend do |port|
+    conns = CONNECTIONS.times.map{ TCPSocket.new '127.0.0.1', port }
+    conns.each{|c| http_get c, '/' } # warm up
+
+    Ext.rdtsc_start
+    REQUESTS.times do
+      conns.each{|c| c << "GET / HTTP/1.1\r\nHost: localhost\r\n\r\n" }
+      conns.each{|c| http_read c }
+    end
+    t = Ext.rdtsc
+
+    conns.each &:close
+    t
+  end
+end
+
+res = {}
+Ext.event_backends.each do |backend|
+  res[backend.to_sym] = bench backend
+end
+dump res
@@ -0,0 +1,35 @@
+require_relative "performance_helper"
+
+include Nyara
+
+# count event registration syscalls of a worker serving keep-alive requests,
+# registration should not change per request, nor when the action sleeps
+class EventCtlController < Controller
+  get '/' do
+    send_string 'ok'
+  end
+
+  get '/sleep' do
+    sleep 0.001
+    send_string 'ok'
+  end
+
+  get '/count' do
+    send_string Ext.event_ctl_count.to_s
+  end
+end
+
+serve EventCtlController
+
+def ctl_per_request port, path
+  conn = TCPSocket.new '127.0.0.1', port
+  before = http_get(conn, '/count').to_i
+  100.times{ http_get conn, path }
+  after = http_get(conn, '/count').to_i
+  conn.close
+  (after - before) / 100.0
+end
+
+with_worker do |port|
+  dump plain: ctl_per_request(port, '/'), sleep: ctl_per_request(port, '/sleep')
+end
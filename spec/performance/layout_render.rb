@@ -21,11 +21,11 @@ class MyRenderable
 
   def nyara_render
     view = Nyara::View.new self, 'page.slim', ['layout.slim', 'layout.slim'], {items: @items}, {}
-    Fiber.new{ view.render }.resume
+    catch(:term_close){ view.render }
   end
 
   def tilt_render
-    Fiber.new{}.resume # XXX simulate the overhead of every request
+    catch(:term_close){} # XXX simulate the overhead of every request
     $layout_tilt.render self do
       $layout_tilt.render self do
         $page_tilt.render self, items: @items
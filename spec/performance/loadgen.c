@@ -0,0 +1,396 @@
+/* HTTP load generator for `rake bench`
+ *
+ *   loadgen [-h host] [-p port] [-c concurrency] [-d seconds] [-r rate] [-k 0|1] [path]
+ *
+ * closed loop (default): every connection sends the next request as soon as its response arrives.
+ * open loop (-r rate): requests are scheduled at a fixed rate no matter how fast responses come,
+ * and latency is measured from the scheduled time, so a stalled server can not hide behind fewer requests.
+ * with -k 0 every request is sent on a new connection, and latency includes connect.
+ *
+ * results are printed to stdout as one JSON object.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <netdb.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+enum { C_IDLE, C_CONNECTING, C_WRITING, C_READING };
+
+typedef struct {
+  int fd;          // -1 if not connected
+  int state;
+  double start;    // latency is measured from here
+  long sent;       // bytes of request sent
+  char* buf;       // response received
+  long len;
+  long capa;
+} Conn;
+
+static struct addrinfo* addr;
+static char* request;
+static long request_len;
+static bool keep_alive = true;
+
+static double* latencies; // in seconds
+static long latencies_len = 0;
+static long latencies_capa = 0;
+static long errors = 0;
+static long non_2xx = 0;
+
+// open loop: scheduled times of requests not sent yet, FIFO
+static double* pending;
+static long pending_head = 0;
+static long pending_len = 0;
+static long pending_capa = 0;
+
+static double _now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void* _grow(void* p, long* capa, long size) {
+  *capa = *capa ? *capa * 2 : 4096;
+  p = realloc(p, *capa * size);
+  if (!p) {
+    perror("realloc");
+    exit(1);
+  }
+  return p;
+}
+
+static void _pending_push(double at) {
+  if (pending_head + pending_len == pending_capa) {
+    if (pending_head) {
+      memmove(pending, pending + pending_head, pending_len * sizeof(double));
+      pending_head = 0;
+    } else {
+      pending = _grow(pending, &pending_capa, sizeof(double));
+    }
+  }
+  pending[pending_head + pending_len++] = at;
+}
+
+static double _pending_shift() {
+  pending_len--;
+  return pending[pending_head++];
+}
+
+static void _record(double latency) {
+  if (latencies_len == latencies_capa) {
+    latencies = _grow(latencies, &latencies_capa, sizeof(double));
+  }
+  latencies[latencies_len++] = latency;
+}
+
+static void _close(Conn* c) {
+  if (c->fd >= 0) {
+    close(c->fd);
+    c->fd = -1;
+  }
+  c->state = C_IDLE;
+}
+
+static void _connect(Conn* c) {
+  c->fd = socket(addr->ai_family, SOCK_STREAM, 0);
+  if (c->fd < 0) {
+    perror("socket");
+    exit(1);
+  }
+  int one = 1;
+  setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  fcntl(c->fd, F_SETFL, fcntl(c->fd, F_GETFL) | O_NONBLOCK);
+  if (connect(c->fd, addr->ai_addr, addr->ai_addrlen) == 0) {
+    c->state = C_WRITING;
+  } else if (errno == EINPROGRESS) {
+    c->state = C_CONNECTING;
+  } else {
+    errors++;
+    _close(c);
+  }
+}
+
+static void _send(Conn* c) {
+  c->sent = 0;
+  c->len = 0;
+  if (c->fd < 0) {
+    _connect(c);
+  } else {
+    c->state = C_WRITING;
+  }
+}
+
+static void _start(Conn* c, double start) {
+  c->start = start;
+  _send(c);
+}
+
+static void _write(Conn* c) {
+  while (c->sent < request_len) {
+    long n = write(c->fd, request + c->sent, request_len - c->sent);
+    if (n < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        return;
+      }
+      errors++;
+      _close(c);
+      return;
+    }
+    c->sent += n;
+  }
+  c->state = C_READING;
+}
+
+// length of the response if it is complete in buffer, 0 if not yet.
+// responses are framed by Content-Length or chunked encoding
+static long _complete(Conn* c, bool eof) {
+  char* s = c->buf;
+  long len = c->len;
+  char* head_end = NULL;
+  for (long i = 0; i + 3 < len; i++) {
+    if (s[i] == '\r' && s[i + 1] == '\n' && s[i + 2] == '\r' && s[i + 3] == '\n') {
+      head_end = s + i + 4;
+      break;
+    }
+  }
+  if (!head_end) {
+    return 0;
+  }
+  long head_len = head_end - s;
+  for (char* p = s; p < head_end; p++) {
+    if (*p != '\n') {
+      continue;
+    }
+    long rest = head_end - p - 1;
+    if (rest > 15 && strncasecmp(p + 1, "Content-Length:", 15) == 0) {
+      long body_len = atol(p + 16);
+      return len >= head_len + body_len ? head_len + body_len : 0;
+    }
+    if (rest > 26 && strncasecmp(p + 1, "Transfer-Encoding: chunked", 26) == 0) {
+      // the last chunk, no trailers are sent by nyara
+      return (len >= head_len + 5 && memcmp(s + len - 5, "0\r\n\r\n", 5) == 0) ? len : 0;
+    }
+  }
+  // framed by close
+  return eof ? len : 0;
+}
+
+static void _finish(Conn* c, double now) {
+  int status = 0;
+  if (c->len > 12 && sscanf(c->buf, "HTTP/%*d.%*d %d", &status) == 1 && (status < 200 || status >= 400)) {
+    non_2xx++;
+  }
+  _record(now - c->start);
+  if (!keep_alive) {
+    _close(c);
+  }
+  c->state = C_IDLE;
+}
+
+static void _read(Conn* c, double now) {
+  while (true) {
+    if (c->capa - c->len < 16384) {
+      c->buf = _grow(c->buf, &c->capa, 1);
+    }
+    long n = read(c->fd, c->buf + c->len, c->capa - c->len);
+    if (n < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        break;
+      }
+      errors++;
+      _close(c);
+      return;
+    }
+    if (n == 0) {
+      if (c->len == 0) {
+        // persistent connection closed by server (keep-alive limit), send again on a new one
+        _close(c);
+        _send(c);
+      } else if (_complete(c, true)) {
+        _finish(c, now);
+        _close(c);
+      } else {
+        errors++;
+        _close(c);
+      }
+      return;
+    }
+    c->len += n;
+  }
+  if (_complete(c, false)) {
+    _finish(c, now);
+  }
+}
+
+static int _cmp_double(const void* a, const void* b) {
+  double x = *(const double*)a;
+  double y = *(const double*)b;
+  return x < y ? -1 : x > y;
+}
+
+static double _percentile(double p) {
+  if (!latencies_len) {
+    return 0;
+  }
+  long i = (long)(p * latencies_len + 0.5) - 1;
+  if (i < 0) {
+    i = 0;
+  }
+  if (i >= latencies_len) {
+    i = latencies_len - 1;
+  }
+  return latencies[i];
+}
+
+static void _usage(const char* prog) {
+  fprintf(stderr, "usage: %s [-h host] [-p port] [-c concurrency] [-d seconds] [-r rate] [-k 0|1] [path]\n", prog);
+  exit(2);
+}
+
+int main(int argc, char** argv) {
+  const char* host = "127.0.0.1";
+  const char* port = "3000";
+  const char* path = "/";
+  int concurrency = 16;
+  double duration = 10;
+  double rate = 0;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "h:p:c:d:r:k:")) != -1) {
+    switch (opt) {
+      case 'h': host = optarg; break;
+      case 'p': port = optarg; break;
+      case 'c': concurrency = atoi(optarg); break;
+      case 'd': duration = atof(optarg); break;
+      case 'r': rate = atof(optarg); break;
+      case 'k': keep_alive = atoi(optarg) != 0; break;
+      default: _usage(argv[0]);
+    }
+  }
+  if (optind < argc) {
+    path = argv[optind];
+  }
+  if (concurrency <= 0 || duration <= 0 || rate < 0) {
+    _usage(argv[0]);
+  }
+
+  struct addrinfo hints;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_socktype = SOCK_STREAM;
+  int err = getaddrinfo(host, port, &hints, &addr);
+  if (err) {
+    fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(err));
+    return 1;
+  }
+
+  request_len = snprintf(NULL, 0, "GET %s HTTP/1.1\r\nHost: %s\r\n%s\r\n", path, host, keep_alive ? "" : "Connection: close\r\n");
+  request = malloc(request_len + 1);
+  snprintf(request, request_len + 1, "GET %s HTTP/1.1\r\nHost: %s\r\n%s\r\n", path, host, keep_alive ? "" : "Connection: close\r\n");
+
+  Conn* conns = calloc(concurrency, sizeof(Conn));
+  struct pollfd* fds = calloc(concurrency, sizeof(struct pollfd));
+  for (int i = 0; i < concurrency; i++) {
+    conns[i].fd = -1;
+  }
+
+  double begin = _now();
+  double end = begin + duration;
+  double next_at = begin;
+  double now;
+  while ((now = _now()) < end) {
+    if (rate > 0) {
+      for (; next_at <= now; next_at += 1 / rate) {
+        _pending_push(next_at);
+      }
+    }
+    for (int i = 0; i < concurrency; i++) {
+      Conn* c = conns + i;
+      if (c->state != C_IDLE) {
+        continue;
+      }
+      if (rate == 0) {
+        _start(c, now);
+      } else if (pending_len) {
+        _start(c, _pending_shift());
+      }
+      if (c->state == C_WRITING) {
+        _write(c);
+      }
+    }
+
+    int nfds = 0;
+    for (int i = 0; i < concurrency; i++) {
+      Conn* c = conns + i;
+      if (c->state == C_IDLE) {
+        continue;
+      }
+      fds[nfds].fd = c->fd;
+      fds[nfds].events = (c->state == C_READING ? POLLIN : POLLOUT);
+      fds[nfds].revents = 0;
+      nfds++;
+    }
+    int timeout = 100;
+    if (rate > 0) {
+      timeout = (int)((next_at - now) * 1000);
+      timeout = timeout < 0 ? 0 : timeout > 100 ? 100 : timeout;
+    }
+    if (poll(fds, nfds, timeout) < 0 && errno != EINTR) {
+      perror("poll");
+      return 1;
+    }
+
+    now = _now();
+    for (int i = 0, j = 0; i < concurrency && j < nfds; i++) {
+      Conn* c = conns + i;
+      if (c->state == C_IDLE) {
+        continue;
+      }
+      struct pollfd* f = fds + j++;
+      if (!f->revents) {
+        continue;
+      }
+      if (c->state == C_CONNECTING) {
+        int so_err = 0;
+        socklen_t so_len = sizeof(so_err);
+        getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &so_err, &so_len);
+        if (so_err) {
+          errors++;
+          _close(c);
+          continue;
+        }
+        c->state = C_WRITING;
+      }
+      if (c->state == C_WRITING) {
+        _write(c);
+      } else if (c->state == C_READING) {
+        _read(c, now);
+      }
+    }
+  }
+
+  qsort(latencies, latencies_len, sizeof(double), _cmp_double);
+  double sum = 0;
+  for (long i = 0; i < latencies_len; i++) {
+    sum += latencies[i];
+  }
+  printf("{\"path\":\"%s\",\"concurrency\":%d,\"rate\":%g,\"keep_alive\":%s,\"duration\":%g,"
+         "\"requests\":%ld,\"errors\":%ld,\"non_2xx\":%ld,\"unsent\":%ld,\"throughput\":%.1f,"
+         "\"latency_ms\":{\"mean\":%.3f,\"p50\":%.3f,\"p99\":%.3f,\"p999\":%.3f,\"max\":%.3f}}\n",
+         path, concurrency, rate, keep_alive ? "true" : "false", duration,
+         latencies_len, errors, non_2xx, pending_len, latencies_len / duration,
+         latencies_len ? sum / latencies_len * 1000 : 0, _percentile(0.5) * 1000, _percentile(0.99) * 1000,
+         _percentile(0.999) * 1000, latencies_len ? latencies[latencies_len - 1] * 1000 : 0);
+  return 0;
+}
@@ -0,0 +1,66 @@
+require_relative "performance_helper"
+
+include Nyara
+
+# p99 latency of small requests while a worker also serves a fast uploader and CPU heavy actions.
+# compare budgets on (fair) with unlimited reads and no yielding (greedy)
+class MixedLoadController < Controller
+  get '/' do
+    send_string 'ok'
+  end
+
+  post '/upload' do
+    send_string request.body.bytesize.to_s
+  end
+
+  get '/heavy' do
+    t = Time.now
+    while Time.now - t < 0.05
+      1000.times{|i| i * i }
+      Nyara.yield_if_over_budget
+    end
+    send_string 'ok'
+  end
+end
+
+serve MixedLoadController
+
+UPLOAD = 'x' * (8 * 1024 * 1024)
+
+def p99 read_budget, cpu_budget
+  with_worker nil, setup: -> { Ext.set_budget read_budget, cpu_budget } do |port|
+    stop = false
+    uploader = Thread.new do
+      conn = TCPSocket.new '127.0.0.1', port
+      until stop
+        conn << "POST /upload HTTP/1.1\r\nHost: localhost\r\nContent-Length: #{UPLOAD.bytesize}\r\n\r\n"
+        conn << UPLOAD
+        http_read conn
+      end
+      conn.close
+    end
+    heavies = 2.times.map do
+      Thread.new do
+        conn = TCPSocket.new '127.0.0.1', port
+        http_get conn, '/heavy' until stop
+        conn.close
+      end
+    end
+
+    begin
+      conn = TCPSocket.new '127.0.0.1', port
+      latencies = 200.times.map do
+        t = Time.now
+        http_get conn, '/'
+        (Time.now - t).tap{ Kernel.sleep 0.002 }
+      end
+      conn.close
+      latencies.sort[(latencies.size * 0.99).to_i - 1]
+    ensure
+      stop = true
+      [uploader, *heavies].each &:kill
+    end
+  end
+end
+
+dump fair: p99(65536, 1000), greedy: p99(2**40, 0)
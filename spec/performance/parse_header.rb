@@ -0,0 +1,48 @@
+require_relative "performance_helper"
+require "socket"
+
+include Nyara
+
+# headers are kept as raw offsets until the app asks for them,
+# a request that never reads `request.header` should allocate less
+class HeaderBenchController < Controller
+  get '/' do
+    request.header if $materialize
+    send_string 'ok'
+  end
+end
+
+configure do
+  reset
+  map '/', HeaderBenchController
+  set :logger, false
+end
+Nyara.setup
+
+DATA = "GET / HTTP/1.1\r\n" + %w[
+  Host Accept Accept-Language Accept-Encoding User-Agent Referer Cookie Connection Cache-Control
+].map{|k| "#{k}: value-of-#{k.downcase}\r\n" }.join + "\r\n"
+
+def allocations materialize
+  $materialize = materialize
+  client, server = Socket.pair :UNIX, :STREAM
+  GC.start
+  before = GC.stat :total_allocated_objects
+  100.times do
+    request = Ext.request_new
+    Ext.request_set_fd request, server.fileno
+    client << DATA
+    Ext.handle_request request
+    client.read_nonblock 4096 rescue nil
+    Ext.request_unset_fd request
+  end
+  GC.stat(:total_allocated_objects) - before
+ensure
+  server.close
+  client.close
+end
+
+allocations false
+allocations true
+
+dump lazy: allocations(false), eager: allocations(true)
@@ -0,0 +1,34 @@
+require_relative "performance_helper"
+
+# the multipart corpus re-encoded as base64 and quoted-printable parts, split into socket-read-sized chunks
+CORPUS = File.binread(__dir__ + '/../raw_requests/multipart') * 100
+
+def chunks encoded
+  encoded.gsub("\n", "\r\n").scan /.{1,4096}/mn
+end
+
+BASE64_CHUNKS = chunks [CORPUS].pack('m')
+QP_CHUNKS = chunks [CORPUS].pack('M')
+
+def nyara
+  Nyara::Ext.rdtsc_start
+  Nyara::Ext.part_decode 'base64', BASE64_CHUNKS
+  Nyara::Ext.part_decode 'quoted-printable', QP_CHUNKS
+  Nyara::Ext.rdtsc
+end
+
+def ruby
+  Nyara::Ext.rdtsc_start
+  part = Nyara::Part.new 'Content-Transfer-Encoding' => 'base64'
+  BASE64_CHUNKS.each{|c| part.update c.dup }
+  part.final
+  part = Nyara::Part.new 'Content-Transfer-Encoding' => 'quoted-printable'
+  QP_CHUNKS.each{|c| part.update c.dup }
+  part.final
+  Nyara::Ext.rdtsc
+end
+
+nyara
+ruby
+
+dump nyara: nyara, ruby: ruby
@@ -10,3 +10,52 @@ def dump data
     p data
   end
 end
+
+# keep-alive GET on a connection to nyara, returns body
+def http_get conn, path
+  conn << "GET #{path} HTTP/1.1\r\nHost: localhost\r\n\r\n"
+  http_read conn
+end
+
+# read a response from nyara, returns body (responses are chunked)
+def http_read conn
+  while conn.gets != "\r\n"
+  end
+  body = ''
+  while (size = conn.gets.to_i(16)) > 0
+    body << conn.read(size)
+    conn.gets
+  end
+  conn.gets
+  body
+end
+
+# map [controller] at '/' with keep-alive, for benchmarks running the event loop
+def serve controller, keep_alive: 100_000
+  configure do
+    reset
+    map '/', controller
+    set :logger, false
+    set :keep_alive, keep_alive
+  end
+  Nyara.setup
+end
+
+# run the event loop with [backend] (nil for the default one) in a forked worker, yields the port.
+# [setup] is called in the worker before the loop starts. the worker is killed after the block
+def with_worker backend = nil, setup: nil
+  server = TCPServer.new '127.0.0.1', 0
+  port = server.addr[1]
+  pid = fork do
+    setup.call if setup
+    Nyara::Ext.init_queue backend
+    Nyara::Ext.run_queue server.fileno
+  end
+  server.close
+  yield port
+ensure
+  if pid
+    Process.kill :KILL, pid
+    Process.wait pid
+  end
+end
@@ -0,0 +1,53 @@
+require_relative "performance_helper"
+
+include Nyara
+
+# ruby objects allocated by a worker per request, counted by GC.stat in the worker.
+# requests and action fibers are pooled, so a request on a new connection
+# should allocate about the same as a keep-alive one
+class RequestPoolController < Controller
+  get '/' do
+    send_string 'ok'
+  end
+
+  get '/allocated' do
+    send_string GC.stat(:total_allocated_objects).to_s
+  end
+end
+
+serve RequestPoolController
+
+N = 200
+
+def allocated port
+  conn = TCPSocket.new '127.0.0.1', port
+  http_get(conn, '/allocated').to_i
+ensure
+  conn.close
+end
+
+def keep_alive port
+  conn = TCPSocket.new '127.0.0.1', port
+  http_get conn, '/' # warm up pools
+  before = http_get(conn, '/allocated').to_i
+  N.times{ http_get conn, '/' }
+  after = http_get(conn, '/allocated').to_i
+  conn.close
+  (after - before) / N.to_f
+end
+
+def new_conn port
+  before = allocated port
+  N.times do
+    conn = TCPSocket.new '127.0.0.1', port
+    http_get conn, '/'
+    conn.close
+  end
+  after = allocated port
+  (after - before) / N.to_f
+end
+
+with_worker do |port|
+  new_conn port # warm up pools
+  dump keep_alive: keep_alive(port), new_conn: new_conn(port)
+end
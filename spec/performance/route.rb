@@ -0,0 +1,36 @@
+require_relative "performance_helper"
+
+include Nyara
+
+# a large route table, lookup time should not grow with the position of matched route
+ROUTES = (0...900).map do |i|
+  r = Route.new
+  r.path = "/resource#{i}/%d/edit"
+  r.compile 'stub', '/'
+  r.http_method = HTTP_METHODS['GET']
+  r.id = :"#edit#{i}"
+  r.set_accept_exts nil
+  r
+end
+ROUTES.sort_by! &:prefix
+ROUTES.reverse!
+Ext.clear_route
+ROUTES.each do |r|
+  Ext.register_route r
+end
+
+FIRST = ROUTES.first.prefix + '12/edit'
+LAST = ROUTES.last.prefix + '12/edit'
+
+def lookup path
+  Ext.rdtsc_start
+  100.times do
+    Ext.lookup_route 'GET', path, nil
+  end
+  Ext.rdtsc
+end
+
+lookup FIRST
+lookup LAST
+
+dump first: lookup(FIRST), last: lookup(LAST)
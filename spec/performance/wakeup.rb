@@ -0,0 +1,28 @@
+require_relative "performance_helper"
+
+include Nyara
+
+# latency of waking a sleeping action from another thread,
+# measured in the worker from `request.waker` called to the action resumed
+class WakeupController < Controller
+  get '/' do
+    wake = request.waker
+    woken_at = nil
+    Thread.new do
+      Kernel.sleep 0.001
+      woken_at = Time.now
+      wake.call
+    end
+    sleep 1
+    send_string (Time.now - woken_at).to_s
+  end
+end
+
+serve WakeupController
+
+with_worker do |port|
+  conn = TCPSocket.new '127.0.0.1', port
+  latencies = 20.times.map{ http_get(conn, '/').to_f }
+  conn.close
+  dump latency: latencies.inject(:+) / latencies.size
+end
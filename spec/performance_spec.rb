@@ -33,6 +33,49 @@ describe 'performance' do
     assert res[:nyara] * 0.9 < res[:tilt], res.inspect
   end
 
+  it "[route] lookup time doesn't grow with route table size" do
+    res = bm 'route'
+    assert res[:last] < res[:first] * 3, res.inspect
+  end
+
+  it "[parse_header] headers not read are not allocated" do
+    res = bm 'parse_header'
+    assert res[:lazy] < res[:eager], res.inspect
+  end
+
+  it "[part_decode] faster than decoding parts in ruby" do
+    res = bm 'part_decode'
+    assert res[:nyara] * 5 < res[:ruby], res.inspect
+  end
+
+  it "[event_ctl] no event registration syscall per keep-alive request" do
+    res = bm 'event_ctl'
+    assert res[:plain] < 0.1, res.inspect
+    assert res[:sleep] < 0.1, res.inspect
+  end
+
+  it "[event_backend] io_uring is not slower than epoll" do
+    res = bm 'event_backend'
+    if res[:io_uring]
+      assert res[:io_uring] < res[:epoll] * 1.1, res.inspect
+    end
+  end
+
+  it "[request_pool] new connections allocate about as few objects as keep-alive requests" do
+    res = bm 'request_pool'
+    assert res[:new_conn] < res[:keep_alive] + 5, res.inspect
+  end
+
+  it "[wakeup] action woken by another thread resumes without waiting for heartbeat" do
+    res = bm 'wakeup'
+    assert res[:latency] < 0.01, res.inspect
+  end
+
+  it "[mixed_load] budgets bound tail latency of small requests" do
+    res = bm 'mixed_load'
+    assert res[:fair] < res[:greedy], res.inspect
+  end
+
   it "[escape] faster than CGI.escape" do
     res = bm 'escape'
     assert res[:nyara] * 8 < res[:cgi], res.inspect
@@ -66,6 +66,21 @@ module Nyara
       assert_equal 'baz', @request.param[:foo][:bar]
     end
 
+    it "buffers output until flush" do
+      client, server = Socket.pair :UNIX, :STREAM
+      Ext.request_set_fd @request, server.fileno
+      Ext.request_send_data @request, ["HTTP/1.1 200 OK\r\n", "", "Content-Length: 0\r\n", "\r\n"]
+      assert_raise Errno::EAGAIN do
+        client.read_nonblock 100
+      end
+      Ext.request_flush @request
+      Ext.request_unset_fd @request
+      assert_equal "HTTP/1.1 200 OK\r\nContent-Length: 0\r\n\r\n", client.read_nonblock(100)
+    ensure
+      client.close
+      server.close
+    end
+
     def request_set_attrs
       Ext.request_set_attrs @request, @request_attrs
     end
@@ -25,7 +25,7 @@ module Nyara
     def render *xs
       @instance = RenderableMock.new
       view = View.new @instance, *xs
-      Fiber.new{ view.render }.resume
+      catch(:term_close){ view.render }
     end
 
     it "inline render with locals" do
@@ -89,7 +89,7 @@ module Nyara
       assert_equal "<html>0", @instance.result
       v.resume
       assert_equal "<html>01", @instance.result
-      Fiber.new{ v.end }.resume
+      catch(:term_close){ v.end }
       assert_equal "<html>012</html>\n", @instance.result
     end
   end